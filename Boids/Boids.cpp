@@ -83,8 +83,13 @@ Written by: F. Estrada, Jun 2011.
    library files (you may have to update the Makefile)
 */
 
+#ifdef __APPLE__
 #include <OpenGL/OpenGL.h>
 #include <GLUT/GLUT.h>
+#else
+#include <GL/gl.h>
+#include <GL/glut.h>
+#endif
 #include "imgui.h"
 #include "imgui_impl_glut.h"
 
@@ -94,25 +99,45 @@ Written by: F. Estrada, Jun 2011.
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <chrono>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "BoidsSim.h"
+#include "BoidsRender.h"
+#include "BoidsScene.h"
+#include "BoidsProfile.h"
+#include "BoidsKernels.h"
+#ifdef BOIDS_OFFSCREEN
+#include "BoidsOffscreen.h"
+#endif
 
 // *************** GLOBAL VARIABLES *************************
-#define MAX_BOIDS 2000
-#define SPACE_SCALE 75
-#define SPEED_SCALE 5
-#define HISTORY 100                 // Amount of previous locations points to keep
+#define HISTORY 100                 // Default amount of previous locations points to keep
+#define MAX_HISTORY 5000            // Longest trail selectable from the UI
 const float PI = 3.14159;
-int nBoids;				// Number of boids to dispay
-float Boid_Location[MAX_BOIDS][3];	// Pointers to dynamically allocated
-float Boid_Velocity[MAX_BOIDS][3];	// Boid position & velocity data
-float Boid_Color[MAX_BOIDS][3];	 	// RGB colour for each boid
-float Boid_Past_Locations[MAX_BOIDS][HISTORY][3];   // Previous locations of each boid
-float *modelVertices;               // Imported model vertices
-int Boid_Model_Vertex[MAX_BOIDS];	// Assigned model vertex for boid i
-int n_vertices;                     // Number of model vertices
-int nLeaders;						// How many leaders there are
-int leaders[5];						// Array of leaders
+Vec3Array Boid_Color;			// RGB colour for each boid
+float *Boid_Past_Locations;         // Previous locations of each boid, see assignPastLocations()
+int trailLength;                    // Number of previous locations kept per boid
+int trailHead;                      // Slot of Boid_Past_Locations holding the newest location
 float swimPhase;					// Controls swimming animation for boid
 float swimSpeed;                    // Speed at which boid swims
+float *Boid_Swim_Offset;            // Each boid's own swim phase and rate, see assignSwimPhases()
+float *Boid_Swim_Rate;
+float *Boid_Transforms;             // 3x4 transform placing each boid, see computeBoidTransforms()
+GLuint Fish_Lists;                  // Display lists for the parts of a boid, see buildFishLists()
+enum {FISH_UPPER_BODY, FISH_HEAD, FISH_FIN, FISH_LOWER_BODY, FISH_TAIL, FISH_ELLIPSOID, FISH_PARTS};
+BoidLODs Boid_LODs;                 // Boids left to draw this frame, see cullBoids()
+BoidFrame Drawn_Frame;              // The flock as drawn, between the last two ticks
+bool interpolating;                 // Drawn_Frame has not caught up with the newest tick
+float *Point_Locations;             // (x,y,z) and (r,g,b) of the boids drawn as points,
+float *Point_Colors;                // see drawBoidPoints()
+#define UI_REDRAWS 3                // Frames drawn after user input, for ImGui to catch up
+double nextFrameTime;               // When the next frame is due, see scheduleFrame()
+bool frameScheduled;                // A frameTimer() call is pending
+bool windowVisible;
+int uiRedraws;                      // Frames still to draw after user input
 
 // *************** USER INTERFACE VARIABLES *****************
 int windowID;               // Glut window ID (for display)
@@ -130,6 +155,23 @@ float k_ruleLeader;		// Crunchy follow the leader
 float k_ruleHover;		// Crunchy hover over model vertex
 float shapeness;
 float global_rot;
+float camera_dist;          // Distance of the camera from the centre of the box
+float lod_ellipsoid;        // Boids farther from the camera than this are drawn as ellipsoids,
+float lod_point;            // and farther than this as points
+int nThreads;               // Threads used for the boid update
+int kernel;                 // SIMD kernel for the neighbour sums, see BoidsKernels.h
+float skin;                 // Margin of the neighbour lists, 0 for none
+int reorderInterval;        // Ticks between sorting the boids in memory, 0 for never
+bool pairs;                 // Visit each pair of boids once, for both of them
+float simTickRate;          // Simulation ticks per second
+bool paused;                // Stop advancing the flock
+int substeps;               // Most ticks the simulation runs to catch up
+bool interpolate;           // Draw the flock in between ticks
+float targetFps;            // Frames drawn per second, at most
+bool idleWhenUnchanged;     // Only redraw when there is something new to show
+bool instancedSupported;    // Whether the GL supports instanced rendering
+bool drawInstanced;         // Draw all boids with one instanced draw call
+bool trailBuffer;           // Trails are kept in a vertex buffer, see uploadTrails()
 
 // ***********  FUNCTION HEADER DECLARATIONS ****************
 // Initialization functions
@@ -145,32 +187,33 @@ void MotionFunc(int x, int y) ;
 void PassiveMotionFunc(int x, int y) ;
 void KeyboardPress(unsigned char key, int x, int y);
 void KeyboardPressUp(unsigned char key, int x, int y);
+void WindowVisibility(int state);
+void frameTimer(int);
+
+// Frame pacing
+void scheduleFrame();
 
 void setupUI();
+void quitButton(int);
+void renderOffscreen(int nFrames, int ticksPerFrame);
 
-// Return the current system clock (in seconds)
+// Return the current time from a monotonic clock (in seconds)
 double getTime();
 
-// Functions for handling Boids
-float sign(float x){if (x>=0) return(1.0); else return(-1.0);}
-void updateBoid(int i);
+// Functions for handling Boids (the update is in BoidsSim.cpp)
 void drawBoid(int i);
+void drawBoidEllipsoid(int i);
+void drawBoidPoints(BoidFrame *frame, BoidLODs *lods);
+void buildFishLists();
 void HSV2RGB(float H, float S, float V, float *R, float *G, float *B);
 
-// Functions to compute effects of boid rules in update function
-void applyRule1(int boidIdx, float *v);
-void applyRule2(int boidIdx, float *v);
-void applyRule3(int boidIdx, float *v);
-void followLeaders(int boidIdx, float *v);
-void followModelVertex(int boidIdx, float *v);
-
 // General helper functions
-float distance(float *p1, float *p2, int dim);
-int boidsInRange(int boidIdx, float range, int *allInRange);
-bool isLeader(int boidIdx);
-void assignToModelVertices();
 void assignToColors();
+void assignSwimPhases();
 void assignPastLocations();
+void setTrailLength(int length);
+void recordTrajectories();
+void publishParams();
 void drawTrajectory(int i);
 int min(int a,int b) {return a<b ? a : b;}
 
@@ -186,32 +229,88 @@ int min(int a,int b) {return a<b ? a : b;}
 */
 int main(int argc, char** argv)
 {
-    // Process program arguments
-    if(argc < 4 || argc > 5) {
-        fprintf(stderr,"Usage: Boids width height nBoids [3dmodel]\n");
+    // Process program arguments. Options come first, followed by the
+    // positional arguments.
+    BoidParams defaults;
+    defaultParams(&defaults);
+    nThreads=defaults.nThreads;
+    kernel=defaults.kernel;
+    skin=defaults.skin;
+    reorderInterval=defaults.reorderInterval;
+    pairs=defaults.pairs;
+    simTickRate=defaults.tickRate;
+    substeps=defaults.substeps;
+    paused=defaults.paused;
+    interpolate=true;
+    int opt;
+    bool badArgs=false;
+#ifdef BOIDS_OFFSCREEN
+    int nFrames=300;                // Frames to render
+    int ticksPerFrame=1;
+    const char *framePrefix="frame";
+    const char *profileName=NULL;   // CSV file for the profile, see dumpProfile()
+    while ((opt=getopt(argc, argv, "t:r:f:s:o:p:")) != -1) {
+#else
+    while ((opt=getopt(argc, argv, "t:r:")) != -1) {
+#endif
+        switch (opt) {
+            case 't': nThreads=atoi(optarg); break;
+            case 'r': simTickRate=atof(optarg); break;
+#ifdef BOIDS_OFFSCREEN
+            case 'f': nFrames=atoi(optarg); break;
+            case 's': ticksPerFrame=atoi(optarg); break;
+            case 'o': framePrefix=optarg; break;
+            case 'p': profileName=optarg; break;
+#endif
+            default: badArgs=true; break;
+        }
+    }
+#ifdef BOIDS_OFFSCREEN
+    if (ticksPerFrame < 1) badArgs=true;
+#endif
+    char **args=argv+optind;        // Positional arguments
+    int nArgs=argc-optind;
+    if(badArgs || nArgs < 3 || nArgs > 4 || nThreads < 1 || simTickRate <= 0) {
+#ifdef BOIDS_OFFSCREEN
+        fprintf(stderr,"Usage: BoidsOffscreen [-t threads] [-f frames] [-s ticks] [-o prefix] [-p profile.csv] width height nBoids [3dmodel]\n");
+        fprintf(stderr," width & height control the size of the frames\n");
+#else
+        fprintf(stderr,"Usage: Boids [-t threads] [-r rate] width height nBoids [3dmodel]\n");
         fprintf(stderr," width & height control the size of the graphics window\n");
+#endif
         fprintf(stderr," nBoids determined the number of Boids to draw.\n");
         fprintf(stderr," [3dmodel] is an optional parameter, naming a .3ds file to be read for 3d point clouds.\n");
+        fprintf(stderr," -t sets the number of threads used to update the Boids (default: all cores).\n");
+#ifdef BOIDS_OFFSCREEN
+        fprintf(stderr," -f sets the number of frames to render (default: 300).\n");
+        fprintf(stderr," -s sets the number of simulation ticks per frame (default: 1).\n");
+        fprintf(stderr," -o sets the start of the frame file names (default: frame, for frame00000.ppm...).\n");
+        fprintf(stderr," -p writes the time taken by each phase of the last %d frames to a CSV file.\n", PROFILE_FRAMES-1);
+#else
+        fprintf(stderr," -r sets the simulation rate in ticks per second (default: 60).\n");
+#endif
         exit(0);
     }
-    Win[0]=atoi(argv[1]);
-    Win[1]=atoi(argv[2]);
-    nBoids=atoi(argv[3]);
+    Win[0]=atoi(args[0]);
+    Win[1]=atoi(args[1]);
+    nBoids=atoi(args[2]);
 
-    if (nBoids>MAX_BOIDS)
+    if (nBoids<1)
     {
-     fprintf(stderr,"Too Many Boids! Max=%d\n",MAX_BOIDS);
+     fprintf(stderr,"Need at least one Boid!\n");
      exit(0);
     }
+    allocBoids();
+    Boid_Transforms = allocAligned(nBoids*12);
 
     // If a model file is specified, read it, normalize scale
     n_vertices=0;
     modelVertices=NULL;
-    if (argc==5)
+    if (nArgs==4)
     {
      float mx=0;
      //n_vertices=nBoids;
-     //modelVertices=read3ds(argv[4],&n_vertices);
+     //modelVertices=read3ds(args[3],&n_vertices);
      if (n_vertices>0)
      {
       fprintf(stderr,"Returned %d points\n",n_vertices);
@@ -223,23 +322,14 @@ int main(int argc, char** argv)
     }
 
     // Initialize Boid positions and velocity
-    // Mind the SPEED_SCALE. You may need to change it to
-    // achieve smooth animation - increase it if the
-    // animation is too slow. Decrease it if it's too
-    // fast and choppy.
-    srand48(1522);
-    for (int i=0; i<nBoids; i++)
-    {
-     // Initialize Boid locations and velocities randomly
-     Boid_Location[i][0]=(-.5+drand48())*SPACE_SCALE;
-     Boid_Location[i][1]=(-.5+drand48())*SPACE_SCALE;
-     Boid_Location[i][2]=(-.5+drand48())*SPACE_SCALE;
-     Boid_Velocity[i][0]=(-.5+drand48())*SPEED_SCALE;
-     Boid_Velocity[i][1]=(-.5+drand48())*SPEED_SCALE;
-     Boid_Velocity[i][2]=(-.5+drand48())*SPEED_SCALE;
-    }
+    randomizeBoids(1522);
     
+    // Hand the initial state to the renderer
+    initFrames();
+    allocFrame(&Drawn_Frame);
+
     // Initialize the past locations to the current one
+    trailLength = HISTORY;
     assignPastLocations();
     
     // Assign every boid to a model vertext, if model present
@@ -247,40 +337,66 @@ int main(int argc, char** argv)
     
     // Assign every boid a random color
     assignToColors();
+
+    // Start every boid swimming at its own phase and rate
+    assignSwimPhases();
     
-    // Initialize glut, glui, and opengl
+    // Initialize glut, glui, and opengl. Offscreen, there is no window
+    // (so no GLUT) and no UI.
+#ifdef BOIDS_OFFSCREEN
+    if (!initOffscreen(Win[0], Win[1], framePrefix)) exit(1);
+    WindowReshape(Win[0], Win[1]);
+#else
     glutInit(&argc, argv);
     initGlut(argv[0]);
     ImGui_ImplGlut_Init(false);
+#endif
     GL_Settings_Init();
 
     // Initialize variables that control the boid updates
-    r_rule1=15;
-    r_rule2=1;
-    r_rule3=25;
-    r_ruleLeader=1;
-    k_rule1=0.15;
-    k_rule2=.5;
-    k_rule3=.15;
-    k_rule0=.25;
-    k_ruleLeader=0.0;
-    k_ruleHover=0.0;
+    r_rule1=defaults.r_rule1;
+    r_rule2=defaults.r_rule2;
+    r_rule3=defaults.r_rule3;
+    r_ruleLeader=defaults.r_ruleLeader;
+    k_rule1=defaults.k_rule1;
+    k_rule2=defaults.k_rule2;
+    k_rule3=defaults.k_rule3;
+    k_rule0=defaults.k_rule0;
+    k_ruleLeader=defaults.k_ruleLeader;
+    k_ruleHover=defaults.k_ruleHover;
     shapeness=0;
     global_rot=30;
+    camera_dist=145;
+    lod_ellipsoid=250;
+    lod_point=400;
     
     // Initialize variables that control the boid swimming animation
     swimPhase = 0.0;
     swimSpeed = 0.1;
     
     // Initialize leader list
-    nLeaders = min(rand()%5 + 1, MAX_BOIDS);
-    for (int i = 0; i < nLeaders; ++i) {
-        leaders[i] = rand()%nBoids;
-    }
+    chooseLeaders();
+    
+    // Start advancing the flock
+    publishParams();
+#ifdef BOIDS_OFFSCREEN
+    renderOffscreen(nFrames, ticksPerFrame);
+    if (profileName != NULL) dumpProfile(profileName);
+    quitButton(0);
+#else
+    startSimulation();
+
+    // Draw at most 60 frames per second, and only when something changed
+    targetFps = 60;
+    idleWhenUnchanged = true;
+    uiRedraws = UI_REDRAWS;
+    frameScheduled = false;
+    nextFrameTime = getTime();
     
     // Invoke the standard GLUT main event loop
     glutMainLoop();
     ImGui_ImplGlut_Shutdown();
+#endif
     exit(0);         // never reached
 }
 
@@ -312,28 +428,64 @@ void initGlut(char* winName)
     glutKeyboardFunc(KeyboardPress);
     glutKeyboardUpFunc(KeyboardPressUp);
     glutPassiveMotionFunc(PassiveMotionFunc);
+    glutVisibilityFunc(WindowVisibility);
+    windowVisible = true;
+
+#ifdef __APPLE__
+    // Let glutSwapBuffers() wait for the display's refresh, so frames
+    // are never drawn faster than they can be shown
+    GLint swapInterval = 1;
+    CGLSetParameter(CGLGetCurrentContext(), kCGLCPSwapInterval, &swapInterval);
+#endif
 }
 
+// Input goes to ImGui, which needs a few frames drawn to respond
 void MouseClick(int button, int state, int x, int y) {
     ImGui_ImplGlut_MouseButtonCallback(button, state, x, y);
+    uiRedraws = UI_REDRAWS;
 }
 void MotionFunc(int x, int y) {
     ImGui_ImplGlut_MotionCallback(x, y);
+    uiRedraws = UI_REDRAWS;
 }
 void PassiveMotionFunc(int x, int y) {
     ImGui_ImplGlut_PassiveMotionCallback(x, y);
+    uiRedraws = UI_REDRAWS;
 }
 void KeyboardPress(unsigned char key, int x, int y) {
     ImGui_ImplGlut_KeyCallback(key,x,y);
+    uiRedraws = UI_REDRAWS;
 }
 void KeyboardPressUp(unsigned char key, int x, int y) {
     ImGui_ImplGlut_KeyUpCallback(key,x,y);
+    uiRedraws = UI_REDRAWS;
+}
+
+// Stops drawing while the window is hidden or minimized, and starts
+// again when it is shown
+void WindowVisibility(int state) {
+    windowVisible = (state == GLUT_VISIBLE);
+    if (windowVisible) glutPostRedisplay();
 }
 
 // Quit button handler.  Called when the "quit" button is pressed.
 void quitButton(int)
 {
+  stopSimulation();
   if (modelVertices!=NULL && n_vertices>0) free(modelVertices);
+  if (instancedSupported) freeInstancedRendering();
+  if (trailBuffer) freeTrailRendering();
+  freeStaticGeometry();
+  freeFrame(&Drawn_Frame);
+  freeBoids();
+  freeVec3Array(&Boid_Color);
+  free(Boid_Transforms);
+  free(Boid_Swim_Offset);
+  free(Boid_Swim_Rate);
+  free(Boid_Past_Locations);
+  for (int lod=0; lod<N_LODS; lod++) free(Boid_LODs.boids[lod]);
+  free(Point_Locations);
+  free(Point_Colors);
   exit(0);
 }
 
@@ -407,6 +559,41 @@ void setupUI()
     ImGui::SliderFloat(      "k_ruleHover",     &k_ruleHover, 0.0f, 1.0f);
     
     ImGui::SliderFloat(      "global_rot",     &global_rot, 0.0f, 360.0f);
+    ImGui::SliderFloat(      "camera_dist",    &camera_dist, 50.0f, 350.0f);
+
+    // Distances from the camera beyond which boids are drawn with less detail
+    ImGui::SliderFloat(      "lod_ellipsoid",   &lod_ellipsoid, 0.0f, 500.0f);
+    ImGui::SliderFloat(      "lod_point",       &lod_point, 0.0f, 500.0f);
+    if (lod_point < lod_ellipsoid) lod_point = lod_ellipsoid;
+
+#ifdef _OPENMP
+    ImGui::SliderInt(        "threads",         &nThreads, 1, omp_get_num_procs());
+#endif
+    if (ImGui::Combo(        "kernel",          &kernel, Kernel_Names, N_KERNELS)) {
+        if (!kernelSupported(kernel)) kernel = bestKernel();
+        skin = defaultSkin(kernel);
+    }
+    ImGui::SliderFloat(      "skin",            &skin, 0.0f, 10.0f);
+    ImGui::SliderInt(        "reorder every",   &reorderInterval, 0, 256);
+    ImGui::Checkbox(         "pairs",           &pairs);
+    ImGui::SliderFloat(      "ticks/second",    &simTickRate, 1.0f, 240.0f);
+    ImGui::Checkbox(         "paused",          &paused);
+    ImGui::SliderInt(        "substeps",        &substeps, 1, 16);
+    ImGui::Checkbox(         "interpolate",     &interpolate);
+
+    // Frame pacing, see scheduleFrame()
+    ImGui::SliderFloat(      "frames/second",   &targetFps, 1.0f, 240.0f);
+    ImGui::Checkbox(         "idle when unchanged", &idleWhenUnchanged);
+
+    if (instancedSupported) {
+        ImGui::Checkbox(     "instanced",       &drawInstanced);
+    }
+
+    // Changing the trail length restarts the trails
+    int newTrailLength = trailLength;
+    if (ImGui::SliderInt(    "trail length",    &newTrailLength, 1, MAX_HISTORY)) {
+        setTrailLength(newTrailLength);
+    }
 
     // Add "Quit" button
     if(ImGui::Button("Quit")) {
@@ -415,6 +602,12 @@ void setupUI()
 
     //Some extra info
     ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+    int nDrawn = Boid_LODs.count[LOD_FULL] + Boid_LODs.count[LOD_ELLIPSOID] + Boid_LODs.count[LOD_POINT];
+    ImGui::Text("Boids drawn: %d full, %d ellipsoid, %d point, %d culled", Boid_LODs.count[LOD_FULL],
+                Boid_LODs.count[LOD_ELLIPSOID], Boid_LODs.count[LOD_POINT], nBoids - nDrawn);
+
+    // Where the time goes, phase by phase
+    drawProfilePanel();
 
 
     //End window
@@ -506,6 +699,93 @@ void GL_Settings_Init()
     glEnable(GL_COLOR_MATERIAL);
 
 /***** Illumination setup end ******/
+
+    // The box and the boid geometry never change, so build them once
+    initStaticGeometry();
+    buildFishLists();
+    instancedSupported = initInstancedRendering();
+    drawInstanced = instancedSupported;
+    if (instancedSupported) setInstanceLooks(&Boid_Color, Boid_Swim_Offset, Boid_Swim_Rate);
+
+    // Move the trails to the GPU, if it can draw them
+    trailBuffer = initTrailRendering();
+    if (trailBuffer) uploadTrails(Boid_Past_Locations, trailLength);
+}
+
+// Compiles the parts of a boid into display lists, so drawBoid() only
+// has to set up the animated transforms between them. Each list holds
+// the part's fixed offset, scale and shape; the animated rotations
+// are applied before calling it.
+void buildFishLists()
+{
+    GLUquadric *quad = gluNewQuadric();
+    Fish_Lists = glGenLists(FISH_PARTS);
+
+    // Upper body
+    glNewList(Fish_Lists + FISH_UPPER_BODY, GL_COMPILE);
+    glPushMatrix();
+    glScalef(1, 1, 2);
+    gluSphere(quad, 1, 4, 4);
+    glPopMatrix();
+    glEndList();
+
+    // Horn and eyes. These have their own colours, so the caller
+    // has to set the boid's colour again afterwards.
+    glNewList(Fish_Lists + FISH_HEAD, GL_COMPILE);
+    glColor4f(0.7, 0.7, 0.55, 1);
+    glPushMatrix();
+    glTranslatef(0, -0.15, 1.8);
+    // A cone with its base inside the body. Drawn with GLU rather than
+    // glutSolidCone(), which needs GLUT, and GLUT is not set up offscreen.
+    gluCylinder(quad, 0.15, 0, 1.8, 4, 4);
+    glPopMatrix();
+    glColor4f(0.5, 0.85, 0.85, 1);
+    glPushMatrix();
+    glTranslatef(-0.3, 0.2, 1.7);
+    gluSphere(quad, 0.2, 4, 4);
+    glPopMatrix();
+    glPushMatrix();
+    glTranslatef(0.3, 0.2, 1.7);
+    gluSphere(quad, 0.2, 4, 4);
+    glPopMatrix();
+    glEndList();
+
+    // One fin, about its hinge
+    glNewList(Fish_Lists + FISH_FIN, GL_COMPILE);
+    glPushMatrix();
+    glTranslatef(0, 0, -0.3);
+    glScalef(0.2, 1, 2);
+    gluSphere(quad, 0.35, 4, 4);
+    glPopMatrix();
+    glEndList();
+
+    // Lower body
+    glNewList(Fish_Lists + FISH_LOWER_BODY, GL_COMPILE);
+    glPushMatrix();
+    glTranslatef(0, 0, -1.2);
+    glScalef(1, 1, 2.5);
+    gluSphere(quad, 0.8, 4, 4);
+    glPopMatrix();
+    glEndList();
+
+    // One half of the tail
+    glNewList(Fish_Lists + FISH_TAIL, GL_COMPILE);
+    glPushMatrix();
+    glScalef(1.2, 0.5, 1.5);
+    gluSphere(quad, 0.5, 4, 4);
+    glPopMatrix();
+    glEndList();
+
+    // The whole body as one ellipsoid, for distant boids
+    glNewList(Fish_Lists + FISH_ELLIPSOID, GL_COMPILE);
+    glPushMatrix();
+    glTranslatef(0, 0, -0.6);
+    glScalef(1, 1, 2.8);
+    gluSphere(quad, 1, 4, 4);
+    glPopMatrix();
+    glEndList();
+
+    gluDeleteQuadric(quad);
 }
 
 /*
@@ -520,6 +800,14 @@ void GL_Settings_Init()
 */
 void WindowDisplay(void)
 {
+    // Time every phase of the frame, see BoidsProfile.cpp
+    beginProfileFrame();
+    PhaseTimer wholeFrame(PHASE_FRAME);
+    BoidFrame *frame;
+
+    {
+    PhaseTimer timer(PHASE_SCENE);
+
     // Clear the screen and depth buffers
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glClearColor(clear_color.x, clear_color.y, clear_color.z, clear_color.w);
@@ -541,418 +829,172 @@ void WindowDisplay(void)
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
     
-    // Rotate the camera to the value in global_rot between 0 and 360 degrees
-    gluLookAt(145*cos(global_rot*PI/180.0),145*sin(global_rot*PI/180.0),80,0,0,0,0,0,1);
+    // Rotate the camera to the value in global_rot between 0 and 360 degrees,
+    // at camera_dist from the centre (keeping the original elevation)
+    gluLookAt(camera_dist*cos(global_rot*PI/180.0),camera_dist*sin(global_rot*PI/180.0),camera_dist*80/145,
+              0,0,0,0,0,1);
 
     // Draw box bounding the viewing area
-    glColor4f(.95,.95,.95,.95);
-    glBegin(GL_LINE_LOOP);
-     glVertex3f(-50,-50,-50);
-     glVertex3f(-50,-50,50);
-     glVertex3f(-50,50,50);
-     glVertex3f(-50,50,-50);
-    glEnd();
-
-    glBegin(GL_LINE_LOOP);
-     glVertex3f(-50,-50,-50);
-     glVertex3f(-50,-50,50);
-     glVertex3f(50,-50,50);
-     glVertex3f(50,-50,-50);
-    glEnd();
-
-    glBegin(GL_LINE_LOOP);
-     glVertex3f(-50,-50,-50);
-     glVertex3f(-50,50,-50);
-     glVertex3f(50,50,-50);
-     glVertex3f(50,-50,-50);
-    glEnd();
-
-    glBegin(GL_LINE_LOOP);
-     glVertex3f(50,50,50);
-     glVertex3f(50,50,-50);
-     glVertex3f(50,-50,-50);
-     glVertex3f(50,-50,50);
-    glEnd();
+    drawStaticGeometry();
+    }
 
-    glBegin(GL_LINE_LOOP);
-     glVertex3f(50,50,50);
-     glVertex3f(50,50,-50);
-     glVertex3f(-50,50,-50);
-     glVertex3f(-50,50,50);
-    glEnd();
+    {
+    PhaseTimer timer(PHASE_PREPARE);
+
+    // Pick up the latest frame from the simulation thread, if there is
+    // a new one, and add it to the trails. Otherwise the last frame is
+    // drawn again.
+    if (acquireFrame()) recordTrajectories();
+    frame = &Frames[Frame_Reading];
+    recordPhase(PHASE_TICK, frame->tickTime);
+
+    // Draw the flock one tick behind the simulation, part way from the
+    // state before the newest tick to the newest, so it moves smoothly
+    // whatever the frame rate. Offscreen, every frame is drawn right
+    // after its last tick, so it is drawn as is.
+    interpolating = false;
+#ifndef BOIDS_OFFSCREEN
+    if (interpolate) {
+        float alpha = (getTime() - frame->time)/frame->tickLength;
+        interpolateFrame(frame, alpha, &Drawn_Frame);
+        interpolating = alpha < 1;
+        frame = &Drawn_Frame;
+    }
+#endif
+    computeBoidTransforms(frame, Boid_Transforms);
+    cullBoids(frame, &Boid_LODs, lod_ellipsoid, lod_point);
+    }
 
-    glBegin(GL_LINE_LOOP);
-     glVertex3f(50,50,50);
-     glVertex3f(50,-50,50);
-     glVertex3f(-50,-50,50);
-     glVertex3f(-50,50,50);
-    glEnd();
+    {
+    PhaseTimer timer(PHASE_TRAILS);
+    if (trailBuffer)
+        drawTrails(trailHead, trailLength);	// Draw all trajectories at once
+    else
+        for (int i=0; i<nBoids; i++) drawTrajectory(i);  // Draw the trajectory for boid i
+    }
 
-    for (int i=0; i<nBoids; i++)
     {
-        updateBoid(i);		// Update position and velocity for boid i
-        drawTrajectory(i);  // Draw the trajectory for boid i
-        drawBoid(i);		// Draw this boid
+    PhaseTimer timer(PHASE_BOIDS);
+    if (drawInstanced) {
+        drawBoidsInstanced(Boid_Transforms, swimPhase, &Boid_LODs);	// Draw all boids at once
+    } else {
+        for (int j=0; j<Boid_LODs.count[LOD_FULL]; j++) drawBoid(Boid_LODs.boids[LOD_FULL][j]);
+        for (int j=0; j<Boid_LODs.count[LOD_ELLIPSOID]; j++) drawBoidEllipsoid(Boid_LODs.boids[LOD_ELLIPSOID][j]);
+    }
+    drawBoidPoints(frame, &Boid_LODs);
     }
     swimPhase += swimSpeed;	// move the phase for the next boid animation
 
+#ifndef BOIDS_OFFSCREEN
+    {
+    PhaseTimer timer(PHASE_UI);
     setupUI();
+    }
+#endif
+    publishParams();		// Hand any UI changes to the simulation
+
+    {
+    PhaseTimer timer(PHASE_SWAP);
     // Make sure all OpenGL commands are executed
     glFlush();
 
+#ifndef BOIDS_OFFSCREEN
     // Swap buffers to enable smooth animation
     glutSwapBuffers();
+#endif
+    }
 /***** Scene drawing end ***********/
 
+#ifndef BOIDS_OFFSCREEN
+
   // synchronize variables that GLUT uses
 
-  // Tell glut window to update itself
+  // Tell glut window to update itself, when the next frame is due
   glutSetWindow(windowID);
-  glutPostRedisplay();
+  scheduleFrame();
+#endif
 }
 
-void updateBoid(int i)
+// Sets frameTimer() to go off when the next frame is due, 1/targetFps
+// seconds after the last one was. If drawing fell behind, the next
+// frame is due right away, but no sooner: frames are never drawn in a
+// burst to catch up.
+void scheduleFrame()
 {
-    /*
-     This function updates the position and velocity of Boid i, read the handout
-     and read the reference material in order to understand how the position and
-     velocity are updated.
-     */
-    // Velocity changes obtained from r and k rules
-    float v1[3], v2[3], v3[3], vLead[3], vHover[3];
-    
-    ///////////////////////////////////////////
-    // TO DO: Complete this function to update
-    // the Boid's velocity and location
-    //
-    // Reference: http://www.vergenet.net/~conrad/boids/pseudocode.html
-    //
-    // You need to implement Rules 1, 2, 3, and
-    //  paco's Rule 0. You must also do the
-    //  position update.
-    //
-    // Add at the top of this function any variables
-    // needed.
-    ///////////////////////////////////////////
-    
-    ///////////////////////////////////////////
-    // LEARNING OBJECTIVES: This part of the assignment
-    // is meant to help you learn about
-    //
-    // - Representing quantities using vectors
-    //   and points (velocity, direction of motion,
-    //   position, etc.)
-    // - Vector manipulation. Finding vectors with
-    //   a specific direction, adding and subtracting
-    //   vector quantities.
-    // - Thinking in terms of points, lines, and
-    //   their relationship to vectors:
-    //   Remember, a parametric line is given
-    //   by l(k)= p + (k*v)
-    //   where p is a point, v is  vector in the
-    //   direction of the line, and k a parameter.
-    // - Implementing simple rules that produce
-    //   complex visual behaviour.
-    //
-    // Be sure you fully understand these ideas!
-    // if you run into trouble, come to office
-    // hours.
-    ///////////////////////////////////////////
-    
-    
-    ///////////////////////////////////////////
-    //
-    // TO DO:
-    //
-    // Boid update Rule 1:
-    //  Move boids toward the common center of
-    // mass.
-    //
-    //  In the reference, the center of
-    // mass is computed for ALL boids. Here we
-    // will do it a little differently:
-    //
-    //  Compute the center of mass for all boids
-    // that are within a radius r_rule1 of the
-    // current boid. r_rule1 is a variable that
-    // can be manipulated via the user interface.
-    //
-    //  Once you have obtained a vector from
-    // the current boid to the center of mass
-    // you must update the velocity vector
-    // for this Boid so that it will move
-    // toward the center of mass.
-    //
-    //  The amount it will move toward the
-    // center of mass is given by another user
-    // interface variable called k_rule1.
-    //
-    // In effect:
-    //  Boid_Velocity += (k_rule1) * V1
-    //
-    // where V1 is the vector from the current
-    // boid position to the center of mass.
-    //
-    // Valid ranges are:
-    //  10 <= r_rule1 <= 100
-    //  0 <= k_rule1 <= 1
-    ///////////////////////////////////////////
-    
-    applyRule1(i, v1);
-    
-    ///////////////////////////////////////////
-    // QUESTION:
-    //  Is this the optimal way to implement this
-    // rule? can you see any problems or ways
-    // to improve this bit?
-    ///////////////////////////////////////////
-    
-    
-    
-    ///////////////////////////////////////////
-    //
-    // TO DO:
-    //
-    // Boid update Rule 2:
-    //  Boids steer to avoid collision.
-    //
-    // For each boid j within a small distance
-    // r_rule2 (changeable through the user
-    // interface), compute a vector
-    // from boid(i) to boid(j) (MIND THE DIRECTION!)
-    // then subtract a small amount k_rule2
-    // times this vector from boid(i)'s
-    // velocity. i.e.
-    //
-    // Boid_Velocity[i] -= k_rule2 * V2
-    //
-    // where V2 is the vector from boid(i)
-    // to void(j).
-    //
-    // k_rule2 can be manipulated through the
-    // user interface.
-    //
-    // Valid ranges are
-    //  1 <= r_rule2 <= 15
-    //  0 <= k_rule2 <= 1
-    ///////////////////////////////////////////
-    
-    applyRule2(i, v2);
-    
-    
-    ///////////////////////////////////////////
-    //
-    // TO DO:
-    //
-    // Boid update Rule 3:
-    //  Boids try to match speed with neighbours
-    //
-    //  Average the velocity of any boids within
-    // a given distance r_rule3 from boid(i).
-    // r_rule3 can be manipulated via the user
-    // interface.
-    //
-    //  Once the average velocity has been
-    // computed, add a small factor times this
-    // velocity to the boid's velocity, i.e.
-    //
-    // Boid_Velocity[i] += k_rule3 * V3
-    //
-    // where V3 is the average velocity for
-    // nearby boids and k_rule3 is a parameter
-    // that can be set via the user interface.
-    //
-    // Valid ranges:
-    //
-    // 10 <= r_rule3 <= 100
-    // 0 <= k_rule3 <= 1
-    ///////////////////////////////////////////
-    
-    applyRule3(i, v3);
-    
-    // Crunchy effects
-    followLeaders(i, vLead);
-    followModelVertex(i, vHover);
-    
-    ///////////////////////////////////////////
-    // DONE - CRUNCHY: Add a 'shapeness' component.
-    //  this should give your Boids a tendency
-    //  to hover near one of the points of a
-    //  3D model imported from file. Evidently
-    //  each Boid should hover to a different
-    //  point, and you must figure out how to
-    //  make the void fly toward that spot
-    //  and hover more-or-less around it
-    //  (depending on all Boid parameters
-    //   for the above rules).
-    //
-    //  3D model data is imported for you when
-    //  the user specifies the name of a model
-    //  file in .3ds format from the command
-    //  line.
-    //
-    //  The model data
-    //  is stored in the modelVertices array
-    //  and the number of vertices is in
-    //  n_vertices (if zero, there is no model
-    //  and the shapeness component should
-    //  have no effect whatsoever)
-    //
-    //  The coordinates (x,y,z) of the ith
-    //  mode, vertex can be accessed with
-    //  x=*(modelVertices+(3*i)+0);
-    //  y=*(modelVertices+(3*i)+1);
-    //  z=*(modelVertices+(3*i)+2);
-    //
-    //  Evidently, if you try to access more
-    //  points than there are in the array
-    //  you will get segfault (don't say I
-    //  didn't warn you!). Be careful with
-    //  indexing.
-    //
-    //  shapeness should be in [0,1], and
-    //  there is already a global variable
-    //  to store it. You must add a slider
-    //  to the GUI to control the amount of
-    //  shapeness (i.e. how strong the shape
-    //  constraints affect Boid position).
-    //
-    //  .3ds models can be found online, you
-    //  *must ensure* you are using a freely
-    //  distributable model!
-    //
-    //////////////////////////////////////////
-    
-    ///////////////////////////////////////////
-    //
-    // TO DO:
-    //
-    // Paco's Rule Zero,
-    //
-    //   Boids have inertia - they like to keep
-    // going in the same direction as before.
-    //
-    //   Add a component to the boid velocity
-    // that depends on the previous velocity
-    // (i.e. before the above updates). The weight
-    // of this term is given by k_rule0, which
-    // can be set in the user interface.
-    //
-    // Vaid ranges:
-    //   0 < k_rule0 < 1
-    ///////////////////////////////////////////
-    
-    // Update the velocity with the inertia and the rest of the rules
-    Boid_Velocity[i][0] += (v1[0]+v2[0]+v3[0]+vLead[0]+vHover[0])
-    + k_rule0*Boid_Velocity[i][0];
-    Boid_Velocity[i][1] += (v1[1]+v2[1]+v3[1]+vLead[1]+vHover[1])
-    + k_rule0*Boid_Velocity[i][1];
-    Boid_Velocity[i][2] += (v1[2]+v2[2]+v3[2]+vLead[2]+vHover[2])
-    + k_rule0*Boid_Velocity[i][2];
-    
-    ///////////////////////////////////////////
-    // Enforcing bounds on motion
-    //
-    //  This is already implemented: The goal
-    // is to ensure boids won't stray too far
-    // from the viewing area.
-    //
-    //  This is done exactly as described in the
-    // reference.
-    //
-    //  Bounds on the viewing region are
-    //
-    //  -50 to 50 on each of the X, Y, and Z
-    //  directions.
-    ///////////////////////////////////////////
-    if (Boid_Location[i][0]<-50) Boid_Velocity[i][0]+=1;
-    if (Boid_Location[i][0]>50) Boid_Velocity[i][0]-=1;
-    if (Boid_Location[i][1]<-50) Boid_Velocity[i][1]+=1;
-    if (Boid_Location[i][1]>50) Boid_Velocity[i][1]-=1;
-    if (Boid_Location[i][2]<-50) Boid_Velocity[i][2]+=1;
-    if (Boid_Location[i][2]>50) Boid_Velocity[i][2]-=1;
-    
-    ///////////////////////////////////////////
-    // Velocity Limit:
-    //  This is already implemented. The goal
-    // is simply to avoid boids shooting off
-    // at unrealistic speeds.
-    //
-    //  You can tweak this part if you like,
-    // or you can simply leave it be.
-    //
-    //  The speed clamping used here was determined
-    // 'experimentally', i.e. I tweaked it by hand!
-    ///////////////////////////////////////////
-    Boid_Velocity[i][0]=sign(Boid_Velocity[i][0])*sqrt(fabs(Boid_Velocity[i][0]));
-    Boid_Velocity[i][1]=sign(Boid_Velocity[i][1])*sqrt(fabs(Boid_Velocity[i][1]));
-    Boid_Velocity[i][2]=sign(Boid_Velocity[i][2])*sqrt(fabs(Boid_Velocity[i][2]));
-    
-    ///////////////////////////////////////////
-    // QUESTION: Why add inertia at the end and
-    //  not at the beginning?
-    ///////////////////////////////////////////
-    
-    ///////////////////////////////////////////
-    //
-    // TO DO:
-    //
-    // Finally (phew!) update the position
-    // of this boid.
-    ///////////////////////////////////////////
-    
-    Boid_Location[i][0] += Boid_Velocity[i][0]*1/SPEED_SCALE;
-    Boid_Location[i][1] += Boid_Velocity[i][1]*1/SPEED_SCALE;
-    Boid_Location[i][2] += Boid_Velocity[i][2]*1/SPEED_SCALE;
-    
-    ///////////////////////////////////////////
-    // CRUNCHY:
-    //
-    //  Things you can add here to make the behaviour
-    // more interesting. Be sure to note in your
-    // report any extra work you have done.
-    //
-    // - Add a few obstacles (boxes or something like it)
-    //   and add code to have boids avoid these
-    //   obstacles
-    //
-    // - DONE - Follow the leader: Select a handful
-    //   (1 to 5) boids randomly. Add code so that
-    //   nearby boids tend to move toward these
-    //   'leaders'
-    //
-    // - Make the updates smoother: Idea, instead
-    //   of having hard thresholds on distances for
-    //   the update computations (r_rule1, r_rule2,
-    //   r_rule3), use a weighted computation
-    //   where contributions are weighted by
-    //   distance and the weight decays as a
-    //   function of the corresponding r_rule
-    //   parameter.
-    //
-    // - Add a few 'predatory boids'. Select
-    //   a couple of boids randomly. These become
-    //   predators and the rest of the boids
-    //   should have a strong tendency to
-    //   avoid them. The predatory boids should
-    //   follow the standard rules. However,
-    //   Be sure to plot the predatory boids
-    //   differently so we can easily see
-    //   who they are.
-    //
-    // - Make it go FAST. Consider and implement
-    //   ways to speed-up the boid update. Hint:
-    //   good approximations are often enough
-    //   to give the right visual impression.
-    //   What and how to approximate? that is the
-    //   problem.
-    //
-    //   Thoroughly describe any crunchy stuff in
-    //   the REPORT.
-    //
-    ///////////////////////////////////////////
-    
-    return;
+    if (frameScheduled) return;     // WindowDisplay() was called by GLUT, off schedule
+    double now = getTime();
+    nextFrameTime += 1.0/targetFps;
+    if (nextFrameTime < now) nextFrameTime = now;
+    frameScheduled = true;
+    glutTimerFunc((unsigned int)((nextFrameTime - now)*1000), frameTimer, 0);
+}
+
+// Draws the next frame, when it is due. While the window is hidden
+// nothing is drawn until it is shown again, see WindowVisibility().
+// In idle-when-unchanged mode the frame is skipped, and the check
+// repeated a frame later, when the simulation has nothing new, the
+// flock is drawn at the newest tick already, and there was no user
+// input: the same frame would just be drawn again.
+void frameTimer(int)
+{
+    frameScheduled = false;
+    if (!windowVisible) return;
+    if (idleWhenUnchanged && uiRedraws == 0 && !frameReady() && !interpolating) {
+        scheduleFrame();
+        return;
+    }
+    if (uiRedraws > 0) uiRedraws--;
+    glutPostRedisplay();
+}
+
+// Returns the time in seconds since some fixed point, from a clock
+// that only ever moves forward (unlike the wall clock)
+double getTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef BOIDS_OFFSCREEN
+// Renders nFrames frames into the offscreen framebuffer and saves
+// them (see BoidsOffscreen.cpp). Rather than running on its own
+// thread in real time, the simulation advances ticksPerFrame ticks per
+// frame, so every run gives the same frames however long each takes.
+// The writer thread saves each frame while the next one is simulated.
+void renderOffscreen(int nFrames, int ticksPerFrame)
+{
+    for (int f=0; f<nFrames; f++) {
+        for (int t=0; t<ticksPerFrame; t++) advanceSimulation(0);
+        WindowDisplay();
+        captureFrame(f);
+    }
+    finishOffscreen();
+}
+#endif
+
+// Hands the UI's update parameters to the simulation thread, which
+// picks them up on its next tick
+void publishParams()
+{
+    BoidParams params;
+    params.r_rule1 = r_rule1;
+    params.r_rule2 = r_rule2;
+    params.r_rule3 = r_rule3;
+    params.r_ruleLeader = r_ruleLeader;
+    params.k_rule1 = k_rule1;
+    params.k_rule2 = k_rule2;
+    params.k_rule3 = k_rule3;
+    params.k_rule0 = k_rule0;
+    params.k_ruleLeader = k_ruleLeader;
+    params.k_ruleHover = k_ruleHover;
+    params.nThreads = nThreads;
+    params.kernel = kernel;
+    params.skin = skin;
+    params.reorderInterval = reorderInterval;
+    params.pairs = pairs;
+    params.tickRate = simTickRate;
+    params.substeps = substeps;
+    params.paused = paused;
+    setParams(&params);
 }
 
 void drawBoid(int i)
@@ -1003,100 +1045,66 @@ void drawBoid(int i)
     // Drawing a NARWHAL
     
     // Animation angles for which to rotate body parts
-    float *location = Boid_Location[i];
-    float *velocity = Boid_Velocity[i];
-    float *color = Boid_Color[i];
-    float swimAngle = sin(swimPhase);	// base angle for fin/tail rotation
+    float color[3] = {Boid_Color.x[i], Boid_Color.y[i], Boid_Color.z[i]};
+    float swimAngle = sin(Boid_Swim_Offset[i] + Boid_Swim_Rate[i]*swimPhase);	// base angle for fin/tail rotation
     float leftFinAngle = -50.0 - 20*swimAngle;
     float rightFinAngle = 50.0 + 20*swimAngle;
     float lowerBodyAngle = 10*swimAngle;
     float tailAngle = lowerBodyAngle + 30*swimAngle;
     
-    // Find the angles for the direction in which the narwhal is pointing
-    // in order to rotate it accordingly. Ommiting the 'roll', because it
-    // would necessitate finding the acceleration of the narwhal. Thus,
-    // the narwhal will never be rotated about it's long axes (axis of travel)
-    float origin[3] = {0, 0, 0};
-    float speed = distance(velocity, origin, 3);
-    float speedXY = distance(velocity, origin, 2);
-    float yaw = 180.0/PI*atan2(velocity[1], velocity[0]) + 90;
-    float pitch = -180.0/PI*asinf(velocity[2]/speed) + 90;
+    // The transform pointing the narwhal along its velocity comes from
+    // computeBoidTransforms(). It omits the 'roll', because it would
+    // necessitate finding the acceleration of the narwhal. Thus, the
+    // narwhal will never be rotated about it's long axes (axis of travel)
+    float *m = Boid_Transforms + (size_t)i*12;
+    GLfloat transform[16] = {m[0], m[1], m[2], m[3],
+                             m[4], m[5], m[6], m[7],
+                             m[8], m[9], m[10], m[11],
+                             0, 0, 0, 1};
     
     glColor4f(color[0], color[1], color[2], 1);
-    GLUquadric *quad = gluNewQuadric();
     
     // Transform to the boid's position and orient to it's
     // velocity
     glPushMatrix();
-    glTranslatef(location[0], location[1], location[2]);
-    glRotatef(yaw, 0, 0, 1);
-    glRotatef(pitch, 1, 0, 0);
-    glScalef(1, 1, 1);
+    glMultTransposeMatrixf(transform);
     
     // Draw the upper body
-    glPushMatrix();
-    glScalef(1, 1, 2);
-    gluSphere(quad, 1, 4, 4);
-    glPopMatrix();
+    glCallList(Fish_Lists + FISH_UPPER_BODY);
     
-    // Draw the horn
-    glColor4f(0.7, 0.7, 0.55, 1);
-    glPushMatrix();
-    glTranslatef(0, -0.15, 1.8);
-    glutSolidCone(0.15, 1.8, 4, 4);
-    glPopMatrix();
-    
-    // Draw the eyes
-    glColor4f(0.5, 0.85, 0.85, 1);
-    glPushMatrix();
-    glTranslatef(-0.3, 0.2, 1.7);
-    gluSphere(quad, 0.2, 4, 4);
-    glPopMatrix();
-    glPushMatrix();
-    glTranslatef(0.3, 0.2, 1.7);
-    gluSphere(quad, 0.2, 4, 4);
-    glPopMatrix();
+    // Draw the horn and eyes
+    glCallList(Fish_Lists + FISH_HEAD);
     
     // Draw the fins
     glColor4f(color[0], color[1], color[2], 1);
     glPushMatrix();
     glTranslatef(1, 0, 0.45);
     glRotatef(leftFinAngle, 0, 1, 0);
-    glTranslatef(0, 0, -0.3);
-    glScalef(0.2, 1, 2);
-    gluSphere(quad, 0.35, 4, 4);
+    glCallList(Fish_Lists + FISH_FIN);
     glPopMatrix();
     glPushMatrix();
     glTranslatef(-1, 0, 0.45);
     glRotatef(rightFinAngle, 0, 1, 0);
-    glTranslatef(0, 0, -0.3);
-    glScalef(0.2, 1, 2);
-    gluSphere(quad, 0.35, 4, 4);
+    glCallList(Fish_Lists + FISH_FIN);
     glPopMatrix();
     
     //Draw the lower body and tail
     glPushMatrix();
     // lower body
     glRotatef(lowerBodyAngle, 1, 0, 0);
-    glPushMatrix();
-    glTranslatef(0, 0, -1.2);
-    glScalef(1, 1, 2.5);
-    gluSphere(quad, 0.8, 4, 4);
-    glPopMatrix();
+    glCallList(Fish_Lists + FISH_LOWER_BODY);
     // tail
     glPushMatrix();
     glTranslatef(0.5, 0, -3);
     glRotatef(tailAngle, 1, 0, 0);
     glRotatef(-25, 0, 1, 0);
-    glScalef(1.2, 0.5, 1.5);
-    gluSphere(quad, 0.5, 4, 4);
+    glCallList(Fish_Lists + FISH_TAIL);
     glPopMatrix();
     glPushMatrix();
     glTranslatef(-0.5, 0, -3);
     glRotatef(tailAngle, 1, 0, 0);
     glRotatef(25, 0, 1, 0);
-    glScalef(1.2, 0.5, 1.5);
-    gluSphere(quad, 0.5, 4, 4);
+    glCallList(Fish_Lists + FISH_TAIL);
     glPopMatrix();
     glPopMatrix();
     
@@ -1132,6 +1140,58 @@ void drawBoid(int i)
     
 }
 
+// Draws boid i as a single ellipsoid, for boids too far away for the
+// fins and tail to show
+void drawBoidEllipsoid(int i)
+{
+    float *m = Boid_Transforms + (size_t)i*12;
+    GLfloat transform[16] = {m[0], m[1], m[2], m[3],
+                             m[4], m[5], m[6], m[7],
+                             m[8], m[9], m[10], m[11],
+                             0, 0, 0, 1};
+    glColor4f(Boid_Color.x[i], Boid_Color.y[i], Boid_Color.z[i], 1);
+    glPushMatrix();
+    glMultTransposeMatrixf(transform);
+    glCallList(Fish_Lists + FISH_ELLIPSOID);
+    glPopMatrix();
+}
+
+// Draws the boids too far away to make out their shape as points, all
+// with one draw call
+void drawBoidPoints(BoidFrame *frame, BoidLODs *lods)
+{
+    int n = lods->count[LOD_POINT];
+    if (n == 0) return;
+    if (Point_Locations == NULL) {
+        Point_Locations = (float *)malloc(3*(size_t)nBoids*sizeof(float));
+        Point_Colors = (float *)malloc(3*(size_t)nBoids*sizeof(float));
+    }
+
+    float *locations = Point_Locations;
+    float *colors = Point_Colors;
+    for (int j=0; j<n; j++) {
+        int i = lods->boids[LOD_POINT][j];
+        locations[3*j] = frame->location.x[i];
+        locations[3*j+1] = frame->location.y[i];
+        locations[3*j+2] = frame->location.z[i];
+        colors[3*j] = Boid_Color.x[i];
+        colors[3*j+1] = Boid_Color.y[i];
+        colors[3*j+2] = Boid_Color.z[i];
+    }
+
+    glPushAttrib(GL_LIGHTING_BIT | GL_POINT_BIT);
+    glDisable(GL_LIGHTING);
+    glPointSize(3);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, locations);
+    glColorPointer(3, GL_FLOAT, 0, colors);
+    glDrawArrays(GL_POINTS, 0, n);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glPopAttrib();
+}
+
 void HSV2RGB(float H, float S, float V, float *R, float *G, float *B)
 {
     // Handy function to convert a colour specified as an HSV triplet
@@ -1239,194 +1299,99 @@ void HSV2RGB(float H, float S, float V, float *R, float *G, float *B)
 // return(v_return);
 //}
 
-void applyRule1(int boidIdx, float *v) {
-    float *self_position = Boid_Location[boidIdx];
-    int nearby_boids[MAX_BOIDS];
-    int nNearby = boidsInRange(boidIdx, r_rule1, nearby_boids);
-    int neighbour_idx;
-    float *neighbour_position;
-    float centre[3] = {0, 0, 0};
-    
-    for (int i = 0; i < nNearby; i++) {
-        neighbour_idx = nearby_boids[i];
-        neighbour_position = Boid_Location[neighbour_idx];
-        centre[0] += neighbour_position[0] / nNearby;
-        centre[1] += neighbour_position[1] / nNearby;
-        centre[2] += neighbour_position[2] / nNearby;
+// Gives every boid its own swim phase offset and a rate between 0.75
+// and 1.25 times swimSpeed, so the flock does not flap in lockstep.
+// Uses drand48() so the rand() sequence, which picks the leaders,
+// stays the same.
+void assignSwimPhases() {
+    Boid_Swim_Offset = (float *)malloc(nBoids*sizeof(float));
+    Boid_Swim_Rate = (float *)malloc(nBoids*sizeof(float));
+    if (Boid_Swim_Offset == NULL || Boid_Swim_Rate == NULL) {
+        fprintf(stderr,"Unable to allocate memory for %d boids\n", nBoids);
+        exit(1);
     }
-    
-    v[0] = (centre[0] - self_position[0]) * k_rule1;
-    v[1] = (centre[0] - self_position[1]) * k_rule1;
-    v[2] = (centre[0] - self_position[2]) * k_rule1;
-}
-
-void applyRule2(int boidIdx, float *v) {
-    float *self_position = Boid_Location[boidIdx];
-    int nearby_boids[MAX_BOIDS];
-    int nNearby = boidsInRange(boidIdx, r_rule2, nearby_boids);
-    int neighbour_idx;
-    float *neighbour_position;
-    v[0] = 0;
-    v[1] = 0;
-    v[2] = 0;
-    
-    for (int i = 0; i < nNearby; i++) {
-        neighbour_idx = nearby_boids[i];
-        neighbour_position = Boid_Location[neighbour_idx];
-        v[0] -= (neighbour_position[0] - self_position[0]) * k_rule2;
-        v[1] -= (neighbour_position[1] - self_position[1]) * k_rule2;
-        v[2] -= (neighbour_position[2] - self_position[2]) * k_rule2;
-    }
-}
-
-void applyRule3(int boidIdx, float *v) {
-    int nearby_boids[MAX_BOIDS];
-    int nNearby = boidsInRange(boidIdx, r_rule3, nearby_boids);
-    int neighbour_idx;
-    float *neighbour_velocity;
-    v[0] = 0;
-    v[1] = 0;
-    v[2] = 0;
-    
-    for (int i = 0; i < nNearby; i++) {
-        neighbour_idx = nearby_boids[i];
-        if (neighbour_idx != boidIdx) {	// average not including self
-            neighbour_velocity = Boid_Velocity[neighbour_idx];
-            v[0] += k_rule3 * neighbour_velocity[0] / (nNearby-1);
-            v[1] += k_rule3 * neighbour_velocity[1] / (nNearby-1);
-            v[2] += k_rule3 * neighbour_velocity[2] / (nNearby-1);
-        }
-    }
-}
-
-void followLeaders(int boidIdx, float *v) {
-    float *self_position = Boid_Location[boidIdx];
-    int nearby_boids[MAX_BOIDS];
-    int nNearby = boidsInRange(boidIdx, r_ruleLeader, nearby_boids);
-    int neighbour_idx;
-    float *neighbour_position;
-    v[0] = 0;
-    v[1] = 0;
-    v[2] = 0;
-    
-    for (int i = 0; i < nNearby; i++) {
-        neighbour_idx = nearby_boids[i];
-        if (isLeader(neighbour_idx)) {
-            neighbour_position = Boid_Location[neighbour_idx];
-            v[0] += (neighbour_position[0] - self_position[0]) * k_ruleLeader;
-            v[1] += (neighbour_position[1] - self_position[1]) * k_ruleLeader;
-            v[2] += (neighbour_position[2] - self_position[2]) * k_ruleLeader;
-        }
+    for (int i = 0; i < nBoids; ++i) {
+        Boid_Swim_Offset[i] = 2*PI*drand48();
+        Boid_Swim_Rate[i] = 0.75 + 0.5*drand48();
     }
 }
 
-void followModelVertex(int boidIdx, float *v) {
-    v[0] = 0;
-    v[1] = 0;
-    v[2] = 0;
-    if (n_vertices > 0) {
-        int mIdx = Boid_Model_Vertex[boidIdx];
-        float *self_position = Boid_Location[boidIdx];
-        float *m_position = modelVertices + mIdx*3;
-        v[0] = (m_position[0] - self_position[0]) * k_ruleHover;
-        v[1] = (m_position[1] - self_position[1]) * k_ruleHover;
-        v[2] = (m_position[2] - self_position[2]) * k_ruleHover;
+// Assigns an RGB value to every boid
+void assignToColors() {
+    allocVec3Array(&Boid_Color, nBoids);
+    for (int i = 0; i < nBoids; ++i) {
+        Boid_Color.x[i] = (float)rand()/(float)(RAND_MAX);
+        Boid_Color.y[i] = (float)rand()/(float)(RAND_MAX);
+        Boid_Color.z[i] = (float)rand()/(float)(RAND_MAX);
     }
 }
 
-// Fills an array with indices of all the boids in range of boidIdx,
-// and returns the size of the array
-int boidsInRange(int boidIdx, float range, int *allInRange) {
-    int nInRange = 0;
-    float *self_position = Boid_Location[boidIdx];
-    float *neighbour_position;
-    float dist;
-    
-    for (int i = 0; i < nBoids; i++) {
-        neighbour_position = Boid_Location[i];
-        dist = distance(self_position, neighbour_position, 3);
-        if (dist <= range) {
-            allInRange[nInRange] = i;
-            nInRange++;
-        }
+// Assigns initial values to the past locations of every boid
+// as it's location in the frame being drawn.
+//
+// The trails are kept as a ring of trailLength slots shared by all
+// boids. Each slot holds one location per boid, so boid i's location
+// in slot s is at Boid_Past_Locations + (s*nBoids + i)*3. trailHead is
+// the slot with the newest locations, and adding a point to every
+// trail just moves the head on instead of shifting the history.
+void assignPastLocations() {
+    free(Boid_Past_Locations);
+    Boid_Past_Locations = (float *)malloc((size_t)trailLength*nBoids*3*sizeof(float));
+    if (Boid_Past_Locations == NULL) {
+        fprintf(stderr,"Unable to allocate trails of length %d\n", trailLength);
+        exit(1);
     }
-    
-    return nInRange;
-}
-
-// If there is a .3ds model, assigns each boid to
-// hover around a randomly chosen vertex in the model.
-void assignToModelVertices() {
-    if (n_vertices > 0) {
+    BoidFrame *frame = &Frames[Frame_Reading];
+    for (int j = 0; j < trailLength; j++) {
+        float *past = Boid_Past_Locations + (size_t)j*nBoids*3;
         for (int i = 0; i < nBoids; ++i) {
-            Boid_Model_Vertex[i] = rand() % n_vertices;
+            past[i*3 + 0] = frame->location.x[i];
+            past[i*3 + 1] = frame->location.y[i];
+            past[i*3 + 2] = frame->location.z[i];
         }
     }
+    trailHead = 0;
+    if (trailBuffer) uploadTrails(Boid_Past_Locations, trailLength);
 }
 
-// Assigns an RGB value to every boid
-void assignToColors() {
-    for (int i = 0; i < nBoids; ++i) {
-        Boid_Color[i][0] = (float)rand()/(float)(RAND_MAX);
-        Boid_Color[i][1] = (float)rand()/(float)(RAND_MAX);
-        Boid_Color[i][2] = (float)rand()/(float)(RAND_MAX);
-    }
+// Changes the number of past locations kept for every boid. The
+// trails restart from the boids' current locations.
+void setTrailLength(int length) {
+    if (length < 1) length = 1;
+    if (length == trailLength) return;
+    trailLength = length;
+    assignPastLocations();
 }
 
-// Assigns initial values to the past locations of every boid
-// as it's current location.
-void assignPastLocations() {
-    for (int i = 0; i < nBoids; ++i) {
-        for (int j = 0; j < HISTORY; j++) {
-            Boid_Past_Locations[i][j][0] = Boid_Location[i][0];
-            Boid_Past_Locations[i][j][1] = Boid_Location[i][1];
-            Boid_Past_Locations[i][j][2] = Boid_Location[i][2];
-        }
+// Adds the locations in the renderer's current frame to the trails,
+// overwriting the oldest points
+void recordTrajectories() {
+    BoidFrame *frame = &Frames[Frame_Reading];
+    trailHead = (trailHead + 1) % trailLength;
+    float *newest = Boid_Past_Locations + (size_t)trailHead*nBoids*3;
+    for (int i = 0; i < nBoids; i++) {
+        newest[i*3 + 0] = frame->location.x[i];
+        newest[i*3 + 1] = frame->location.y[i];
+        newest[i*3 + 2] = frame->location.z[i];
     }
+    if (trailBuffer) updateTrail(Boid_Past_Locations, trailHead);
 }
 
 // Draws the trajectory for the given boid
 void drawTrajectory(int i) {
-    // Shift history down
-    for (int j = HISTORY-1; j >= 1; j--) {
-        Boid_Past_Locations[i][j][0] = Boid_Past_Locations[i][j-1][0];
-        Boid_Past_Locations[i][j][1] = Boid_Past_Locations[i][j-1][1];
-        Boid_Past_Locations[i][j][2] = Boid_Past_Locations[i][j-1][2];
-    }
-    
-    // Update the most recent location
-    Boid_Past_Locations[i][0][0] = Boid_Location[i][0];
-    Boid_Past_Locations[i][0][1] = Boid_Location[i][1];
-    Boid_Past_Locations[i][0][2] = Boid_Location[i][2];
-    
-    // Draw the trajectory as points of increasing red-ness
+    // Draw the trajectory as points of increasing red-ness,
+    // from the oldest point (the slot after the head) to the newest
     glBegin(GL_POINTS);
-    for (int j = HISTORY-1; j >=0; j--) {
-        glColor4f((float)(HISTORY-j)/HISTORY, 0.0, 0.0, 1.0);
-        glVertex3f(Boid_Past_Locations[i][j][0],
-                   Boid_Past_Locations[i][j][1],
-                   Boid_Past_Locations[i][j][2]);
+    for (int age = trailLength-1; age >= 0; age--) {
+        int slot = (trailHead - age + trailLength) % trailLength;
+        glColor4f((float)(trailLength-age)/trailLength, 0.0, 0.0, 1.0);
+        glVertex3fv(Boid_Past_Locations + ((size_t)slot*nBoids + i)*3);
     }
     glEnd();
 }
 
-// Distance between p1 and p2 in dim dimensions
-float distance(float *p1, float *p2, int dim) {
-    float sum = 0;
-    for (int i = 0; i < dim; i++) {
-        sum += (p1[i] - p2[i])*(p1[i] - p2[i]);
-    }
-    return sqrt(sum);
-}
 
-bool isLeader(int boidIdx) {
-    for (int i = 0; i < nLeaders; ++i) {
-        if (boidIdx == leaders[i]) {
-            return true;
-        }
-    }
-    return false;
-}
+
 
 
 
@@ -0,0 +1,164 @@
+/***********************************************************
+                     BoidsBench.cpp
+
+	Headless benchmark of the boid update. Links only
+	the simulation (BoidsSim.cpp), no OpenGL or GLUT, so
+	it runs on build machines without a display.
+
+	Runs a number of warm-up steps, then times a number
+	of simulation steps and reports the time per boid
+	per step, the number of neighbours visited per boid
+	per step, and the peak resident memory.
+
+	Usage: BoidsBench [options] nBoids steps
+	See usage() for the options.
+***********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <sys/resource.h>
+
+#include "BoidsSim.h"
+#include "BoidsKernels.h"
+
+// ***********  FUNCTION HEADER DECLARATIONS ****************
+void usage();
+bool setParam(BoidParams *params, const char *assignment);
+long peakRSS();
+
+// ******************** FUNCTIONS ************************
+
+int main(int argc, char** argv)
+{
+    BoidParams params;
+    defaultParams(&params);
+    params.skin=-1;                 // Unset until the kernel is known
+    int warmup=10;
+    long seed=1522;
+    int opt;
+    bool badArgs=false;
+    while ((opt=getopt(argc, argv, "w:t:s:p:k:r:P")) != -1) {
+        switch (opt) {
+            case 'w': warmup=atoi(optarg); break;
+            case 't': params.nThreads=atoi(optarg); break;
+            case 's': seed=atol(optarg); break;
+            case 'p': if (!setParam(&params, optarg)) badArgs=true; break;
+            case 'r': params.reorderInterval=atoi(optarg); break;
+            case 'P': params.pairs=true; break;
+            case 'k':
+                params.kernel=findKernel(optarg);
+                if (params.kernel < 0 || !kernelSupported(params.kernel)) {
+                    fprintf(stderr,"Kernel %s is not known or not supported by this CPU\n", optarg);
+                    badArgs=true;
+                }
+                break;
+            default: badArgs=true; break;
+        }
+    }
+    if (params.skin < 0) params.skin=defaultSkin(params.kernel);
+    char **args=argv+optind;        // Positional arguments
+    int nArgs=argc-optind;
+    if (badArgs || nArgs != 2 || warmup < 0 || params.nThreads < 1 || params.reorderInterval < 0) {
+        usage();
+        exit(1);
+    }
+    nBoids=atoi(args[0]);
+    int steps=atoi(args[1]);
+    if (nBoids<1 || steps<1) {
+        fprintf(stderr,"Need at least one Boid and one step!\n");
+        exit(1);
+    }
+
+    // Same set-up as the interactive program, minus the model and
+    // everything to do with drawing
+    allocBoids();
+    n_vertices=0;
+    modelVertices=NULL;
+    randomizeBoids(seed);
+    srand(seed);
+    chooseLeaders();
+    Sim_Params=params;
+
+    for (int i=0; i<warmup; i++) stepSimulation();
+
+    double visited=0;
+    std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+    for (int i=0; i<steps; i++) {
+        stepSimulation();
+        visited += Sim_Visited;
+    }
+    std::chrono::steady_clock::time_point end=std::chrono::steady_clock::now();
+    double ns=std::chrono::duration<double, std::nano>(end - start).count();
+
+    printf("boids            %d\n", nBoids);
+    printf("steps            %d (+%d warm-up)\n", steps, warmup);
+    printf("threads          %d\n", params.nThreads);
+    printf("kernel           %s\n", Kernel_Names[params.kernel]);
+    printf("reorder every    %d steps\n", params.reorderInterval);
+    printf("neighbours from  %s\n", params.pairs ? "pairs" : params.skin > 0 ? "lists" : "grid");
+    printf("total time       %.3f s\n", ns*1e-9);
+    printf("ns/boid-step     %.2f\n", ns/((double)nBoids*steps));
+    printf("neighbours/boid  %.2f\n", visited/((double)nBoids*steps));
+    if (!params.pairs && params.skin > 0) printf("list builds      %ld (skin %g)\n", Boid_Lists.builds, params.skin);
+    printf("peak RSS         %ld KB\n", peakRSS());
+
+    freeBoids();
+    return 0;
+}
+
+void usage()
+{
+    fprintf(stderr,"Usage: BoidsBench [-w warmup] [-t threads] [-s seed] [-p name=value]... [-k kernel] [-r steps] [-P] nBoids steps\n");
+    fprintf(stderr," nBoids is the number of Boids to simulate, steps the number of timed steps.\n");
+    fprintf(stderr," -w sets the number of untimed steps run first (default: 10).\n");
+    fprintf(stderr," -t sets the number of threads used to update the Boids (default: all cores).\n");
+    fprintf(stderr," -s sets the seed for the initial positions and velocities (default: 1522).\n");
+    fprintf(stderr," -p sets a rule parameter, and may be repeated. Names are\n");
+    fprintf(stderr,"    r1 r2 r3 rLead (radii), k1 k2 k3 k0 kLead (weights) and\n");
+    fprintf(stderr,"    skin (margin of the neighbour lists, 0 to search the grid every step;\n");
+    fprintf(stderr,"    default: 4 with the scalar kernel, 0 with the others).\n");
+    fprintf(stderr," -k sets the neighbour kernel: scalar, avx2 or avx512\n");
+    fprintf(stderr,"    (default: the widest this CPU supports, here %s).\n", Kernel_Names[bestKernel()]);
+    fprintf(stderr," -P visits each pair of Boids once for both, instead of each Boid's neighbours.\n");
+    fprintf(stderr," -r sets the steps between sorting the Boids in memory by position, 0 for never (default: 32).\n");
+}
+
+// Parses a "name=value" rule parameter into params. Returns false
+// if the name is not known.
+bool setParam(BoidParams *params, const char *assignment)
+{
+    const char *eq=strchr(assignment, '=');
+    if (eq == NULL) return false;
+    int len=eq - assignment;
+    float value=atof(eq + 1);
+    struct { const char *name; float *field; } names[] = {
+        {"r1", &params->r_rule1}, {"r2", &params->r_rule2},
+        {"r3", &params->r_rule3}, {"rLead", &params->r_ruleLeader},
+        {"k1", &params->k_rule1}, {"k2", &params->k_rule2},
+        {"k3", &params->k_rule3}, {"k0", &params->k_rule0},
+        {"kLead", &params->k_ruleLeader}, {"skin", &params->skin},
+    };
+    for (unsigned int i=0; i<sizeof(names)/sizeof(names[0]); i++) {
+        if ((int)strlen(names[i].name) == len && strncmp(names[i].name, assignment, len) == 0) {
+            *names[i].field = value;
+            return true;
+        }
+    }
+    fprintf(stderr,"Unknown parameter %.*s\n", len, assignment);
+    return false;
+}
+
+// Returns the peak resident set size of the process in KB
+long peakRSS()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss/1024;    // Reported in bytes on macOS
+#else
+    return usage.ru_maxrss;         // and in KB on Linux
+#endif
+}
@@ -0,0 +1,630 @@
+/***********************************************************
+                     BoidsKernels.cpp
+
+	Kernels visiting the candidate neighbours of one
+	boid for applyRules(). All of them test each
+	neighbour against the four rule radii by squared
+	distance, without branches, and sum what is within
+	each radius:
+	 - neighboursScalar() is plain C++ left to the
+	   compiler to vectorize for whatever it targets;
+	 - neighboursAVX2() tests 8 neighbours at a time;
+	 - neighboursAVX512() tests 16 at a time.
+	The AVX versions are compiled for their instruction
+	set with target attributes, so the rest of the
+	program still runs on any x86-64, and are only
+	called if the CPU supports them (kernelSupported()).
+	Rows of cells and neighbour lists are not a whole
+	number of registers long, so the last load of each
+	is masked.
+
+	The grid forms (neighbours*()) read contiguous runs
+	of the grid's sorted copies; the list forms (list*())
+	gather each boid's listed neighbours by index.
+
+	The pair kernels (pairs*()) are one plain C++ loop,
+	pairRun(), compiled once per instruction set by
+	inlining it into functions with target attributes.
+***********************************************************/
+
+#include <string.h>
+#include <math.h>
+
+#include "BoidsKernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BOIDS_X86 1
+#include <immintrin.h>
+#endif
+
+// *************** GLOBAL VARIABLES *************************
+const char *Kernel_Names[N_KERNELS] = {"scalar", "avx2", "avx512"};
+
+// ***********  FUNCTION HEADER DECLARATIONS ****************
+static int neighboursScalar(const SpatialGrid *grid, const NeighbourQuery *query, NeighbourSums *sums);
+static int listScalar(const NeighbourLists *lists, const Vec3Array *location, const Vec3Array *velocity,
+                      const NeighbourQuery *query, NeighbourSums *sums);
+#ifdef BOIDS_X86
+static int neighboursAVX2(const SpatialGrid *grid, const NeighbourQuery *query, NeighbourSums *sums);
+static int neighboursAVX512(const SpatialGrid *grid, const NeighbourQuery *query, NeighbourSums *sums);
+static int listAVX2(const NeighbourLists *lists, const Vec3Array *location, const Vec3Array *velocity,
+                    const NeighbourQuery *query, NeighbourSums *sums);
+static int listAVX512(const NeighbourLists *lists, const Vec3Array *location, const Vec3Array *velocity,
+                      const NeighbourQuery *query, NeighbourSums *sums);
+static int pairsAVX2(const SpatialGrid *grid, const NeighbourQuery *query, int first, int last, PairSums *sums);
+static int pairsAVX512(const SpatialGrid *grid, const NeighbourQuery *query, int first, int last, PairSums *sums);
+#endif
+static int pairsScalar(const SpatialGrid *grid, const NeighbourQuery *query, int first, int last, PairSums *sums);
+
+// ******************** FUNCTIONS ************************
+
+// Returns whether this CPU (and OS) can run the given kernel
+bool kernelSupported(int kernel) {
+    switch (kernel) {
+        case KERNEL_SCALAR: return true;
+#ifdef BOIDS_X86
+        case KERNEL_AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case KERNEL_AVX512: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("fma");
+#endif
+        default: return false;
+    }
+}
+
+// Returns the widest kernel this CPU supports
+int bestKernel() {
+    int kernel = N_KERNELS - 1;
+    while (!kernelSupported(kernel)) kernel--;
+    return kernel;
+}
+
+// Returns the kernel called name, or -1 if there is none
+int findKernel(const char *name) {
+    for (int k = 0; k < N_KERNELS; k++) {
+        if (strcmp(Kernel_Names[k], name) == 0) return k;
+    }
+    return -1;
+}
+
+// Returns the function for the given kernel, falling back to the
+// scalar one if the CPU cannot run it
+NeighbourKernel neighbourKernel(int kernel) {
+    if (!kernelSupported(kernel)) return neighboursScalar;
+    switch (kernel) {
+#ifdef BOIDS_X86
+        case KERNEL_AVX2: return neighboursAVX2;
+        case KERNEL_AVX512: return neighboursAVX512;
+#endif
+        default: return neighboursScalar;
+    }
+}
+
+// Returns the list form of the given kernel, falling back to the
+// scalar one if the CPU cannot run it
+ListKernel listKernel(int kernel) {
+    if (!kernelSupported(kernel)) return listScalar;
+    switch (kernel) {
+#ifdef BOIDS_X86
+        case KERNEL_AVX2: return listAVX2;
+        case KERNEL_AVX512: return listAVX512;
+#endif
+        default: return listScalar;
+    }
+}
+
+// Returns the pair kernel for the given instruction set, falling back
+// to the scalar one if the CPU cannot run it
+PairKernel pairKernel(int kernel) {
+    if (!kernelSupported(kernel)) return pairsScalar;
+    switch (kernel) {
+#ifdef BOIDS_X86
+        case KERNEL_AVX2: return pairsAVX2;
+        case KERNEL_AVX512: return pairsAVX512;
+#endif
+        default: return pairsScalar;
+    }
+}
+
+static int neighboursScalar(const SpatialGrid *grid, const NeighbourQuery *query, NeighbourSums *sums) {
+    const float *self = query->position;
+    float r1Sq = query->radiusSq[0], r2Sq = query->radiusSq[1];
+    float r3Sq = query->radiusSq[2], rLeadSq = query->radiusSq[3];
+    int nVisited = 0;
+
+    memset(sums, 0, sizeof(*sums));
+    for (int cz = query->lo[2]; cz <= query->hi[2]; cz++) {
+        for (int cy = query->lo[1]; cy <= query->hi[1]; cy++) {
+            // Cells along x are consecutive, so each row is one contiguous
+            // run of the grid's sorted copies. The loop body is branch-free
+            // (the radius tests become masks) so it vectorizes.
+            int rowCell = (cz*grid->dims[1] + cy)*grid->dims[0];
+            int first = grid->cellStart[rowCell + query->lo[0]];
+            int last = grid->cellStart[rowCell + query->hi[0] + 1];
+            nVisited += last - first;
+            const float *px = grid->location.x, *py = grid->location.y, *pz = grid->location.z;
+            const float *vx = grid->velocity.x, *vy = grid->velocity.y, *vz = grid->velocity.z;
+            const float *leader = grid->leader;
+            const int *boids = grid->boids;
+            int boidIdx = query->boid;
+            float mx = 0, my = 0, mz = 0, sx = 0, sy = 0, sz = 0;
+            float ax = 0, ay = 0, az = 0, lx = 0, ly = 0, lz = 0;
+            float c1 = 0, c3 = 0;
+#pragma omp simd reduction(+:mx,my,mz,sx,sy,sz,ax,ay,az,lx,ly,lz,c1,c3)
+            for (int k = first; k < last; k++) {
+                float dx = px[k] - self[0];
+                float dy = py[k] - self[1];
+                float dz = pz[k] - self[2];
+                float distSq = lengthSq(dx, dy, dz);
+
+                // centre of mass includes self
+                float in1 = distSq <= r1Sq ? 1.0f : 0.0f;
+                mx += in1*px[k];
+                my += in1*py[k];
+                mz += in1*pz[k];
+                c1 += in1;
+
+                // self contributes a zero vector
+                float in2 = distSq <= r2Sq ? 1.0f : 0.0f;
+                sx += in2*dx;
+                sy += in2*dy;
+                sz += in2*dz;
+
+                // average not including self
+                float in3 = ((distSq <= r3Sq) & (boids[k] != boidIdx)) ? 1.0f : 0.0f;
+                ax += in3*vx[k];
+                ay += in3*vy[k];
+                az += in3*vz[k];
+                c3 += in3;
+
+                float inLead = distSq <= rLeadSq ? leader[k] : 0.0f;
+                lx += inLead*dx;
+                ly += inLead*dy;
+                lz += inLead*dz;
+            }
+            sums->centre[0] += mx; sums->centre[1] += my; sums->centre[2] += mz;
+            sums->separation[0] += sx; sums->separation[1] += sy; sums->separation[2] += sz;
+            sums->velocity[0] += ax; sums->velocity[1] += ay; sums->velocity[2] += az;
+            sums->leaderPull[0] += lx; sums->leaderPull[1] += ly; sums->leaderPull[2] += lz;
+            sums->n1 += c1;
+            sums->n3 += c3;
+        }
+    }
+    return nVisited;
+}
+
+static int listScalar(const NeighbourLists *lists, const Vec3Array *location, const Vec3Array *velocity,
+                      const NeighbourQuery *query, NeighbourSums *sums) {
+    const float *self = query->position;
+    float r1Sq = query->radiusSq[0], r2Sq = query->radiusSq[1];
+    float r3Sq = query->radiusSq[2], rLeadSq = query->radiusSq[3];
+    const int *list = lists->neighbours + lists->start[query->boid];
+    int n = lists->start[query->boid + 1] - lists->start[query->boid];
+    const float *px = location->x, *py = location->y, *pz = location->z;
+    const float *vx = velocity->x, *vy = velocity->y, *vz = velocity->z;
+    const float *leader = lists->leader;
+    int boidIdx = query->boid;
+    float mx = 0, my = 0, mz = 0, sx = 0, sy = 0, sz = 0;
+    float ax = 0, ay = 0, az = 0, lx = 0, ly = 0, lz = 0;
+    float c1 = 0, c3 = 0;
+#pragma omp simd reduction(+:mx,my,mz,sx,sy,sz,ax,ay,az,lx,ly,lz,c1,c3)
+    for (int j = 0; j < n; j++) {
+        int k = list[j];
+        float dx = px[k] - self[0];
+        float dy = py[k] - self[1];
+        float dz = pz[k] - self[2];
+        float distSq = lengthSq(dx, dy, dz);
+
+        float in1 = distSq <= r1Sq ? 1.0f : 0.0f;
+        mx += in1*px[k];
+        my += in1*py[k];
+        mz += in1*pz[k];
+        c1 += in1;
+
+        float in2 = distSq <= r2Sq ? 1.0f : 0.0f;
+        sx += in2*dx;
+        sy += in2*dy;
+        sz += in2*dz;
+
+        float in3 = ((distSq <= r3Sq) & (k != boidIdx)) ? 1.0f : 0.0f;
+        ax += in3*vx[k];
+        ay += in3*vy[k];
+        az += in3*vz[k];
+        c3 += in3;
+
+        float inLead = distSq <= rLeadSq ? leader[k] : 0.0f;
+        lx += inLead*dx;
+        ly += inLead*dy;
+        lz += inLead*dz;
+    }
+    sums->centre[0] = mx; sums->centre[1] = my; sums->centre[2] = mz;
+    sums->separation[0] = sx; sums->separation[1] = sy; sums->separation[2] = sz;
+    sums->velocity[0] = ax; sums->velocity[1] = ay; sums->velocity[2] = az;
+    sums->leaderPull[0] = lx; sums->leaderPull[1] = ly; sums->leaderPull[2] = lz;
+    sums->n1 = c1;
+    sums->n3 = c3;
+    return n;
+}
+
+// Returns x where mask is all ones and 0 where it is all zeros
+static inline float masked(float x, int mask) {
+    int bits;
+    memcpy(&bits, &x, sizeof bits);
+    bits &= mask;
+    memcpy(&x, &bits, sizeof x);
+    return x;
+}
+
+// The body of the pair kernels. The query boid's own sums are kept in
+// locals and added to its slot at the end; the other boid of each pair
+// is in a different slot every iteration, so its sums are updated in
+// place, and the loop still vectorizes. Each boid sees the other at the
+// opposite offset: separation and the pull toward leaders are added to
+// one and taken from the other.
+__attribute__((always_inline))
+static inline int pairRun(const SpatialGrid *grid, const NeighbourQuery *query, int first, int last, PairSums *sums) {
+    const float *px = grid->location.x, *py = grid->location.y, *pz = grid->location.z;
+    const float *vx = grid->velocity.x, *vy = grid->velocity.y, *vz = grid->velocity.z;
+    const float *leader = grid->leader;
+    int self = query->boid;
+    float selfX = px[self], selfY = py[self], selfZ = pz[self];
+    float selfVX = vx[self], selfVY = vy[self], selfVZ = vz[self];
+    float selfLeader = leader[self];
+    float r1Sq = query->radiusSq[0], r2Sq = query->radiusSq[1];
+    float r3Sq = query->radiusSq[2], rLeadSq = query->radiusSq[3];
+    float *cx = sums->centre.x, *cy = sums->centre.y, *cz = sums->centre.z;
+    float *sx = sums->separation.x, *sy = sums->separation.y, *sz = sums->separation.z;
+    float *ax = sums->velocity.x, *ay = sums->velocity.y, *az = sums->velocity.z;
+    float *lx = sums->leaderPull.x, *ly = sums->leaderPull.y, *lz = sums->leaderPull.z;
+    float *n1 = sums->n1, *n3 = sums->n3;
+    float mx = 0, my = 0, mz = 0, ox = 0, oy = 0, oz = 0;
+    float wx = 0, wy = 0, wz = 0, fx = 0, fy = 0, fz = 0;
+    float c1 = 0, c3 = 0;
+#pragma omp simd reduction(+:mx,my,mz,ox,oy,oz,wx,wy,wz,fx,fy,fz,c1,c3)
+    for (int k = first; k < last; k++) {
+        float dx = px[k] - selfX;
+        float dy = py[k] - selfY;
+        float dz = pz[k] - selfZ;
+        float distSq = lengthSq(dx, dy, dz);
+
+        // Masks rather than products with 0 or 1 or selects, which the
+        // compiler turns back into branches
+        int in1 = -(distSq <= r1Sq);
+        mx += masked(px[k], in1);
+        my += masked(py[k], in1);
+        mz += masked(pz[k], in1);
+        c1 += masked(1.0f, in1);
+        cx[k] += masked(selfX, in1);
+        cy[k] += masked(selfY, in1);
+        cz[k] += masked(selfZ, in1);
+        n1[k] += masked(1.0f, in1);
+
+        int in2 = -(distSq <= r2Sq);
+        float ex = masked(dx, in2), ey = masked(dy, in2), ez = masked(dz, in2);
+        ox += ex;
+        oy += ey;
+        oz += ez;
+        sx[k] -= ex;
+        sy[k] -= ey;
+        sz[k] -= ez;
+
+        int in3 = -(distSq <= r3Sq);
+        wx += masked(vx[k], in3);
+        wy += masked(vy[k], in3);
+        wz += masked(vz[k], in3);
+        c3 += masked(1.0f, in3);
+        ax[k] += masked(selfVX, in3);
+        ay[k] += masked(selfVY, in3);
+        az[k] += masked(selfVZ, in3);
+        n3[k] += masked(1.0f, in3);
+
+        int inLead = -(distSq <= rLeadSq);
+        float toLead = masked(leader[k], inLead), fromLead = masked(selfLeader, inLead);
+        fx += toLead*dx;
+        fy += toLead*dy;
+        fz += toLead*dz;
+        lx[k] -= fromLead*dx;
+        ly[k] -= fromLead*dy;
+        lz[k] -= fromLead*dz;
+    }
+    cx[self] += mx; cy[self] += my; cz[self] += mz;
+    sx[self] += ox; sy[self] += oy; sz[self] += oz;
+    ax[self] += wx; ay[self] += wy; az[self] += wz;
+    lx[self] += fx; ly[self] += fy; lz[self] += fz;
+    n1[self] += c1;
+    n3[self] += c3;
+    return last - first;
+}
+
+static int pairsScalar(const SpatialGrid *grid, const NeighbourQuery *query, int first, int last, PairSums *sums) {
+    return pairRun(grid, query, first, last, sums);
+}
+
+#ifdef BOIDS_X86
+
+// The AVX kernels keep the sums in registers, one lane per neighbour
+// slot, across all the rows or the whole list, and only add them up
+// across lanes at the end. The radius tests and sums are shared by the
+// grid and list forms of each kernel.
+
+#define AVX2 __attribute__((target("avx2,fma")))
+#define AVX512 __attribute__((target("avx512f,avx2,fma")))
+
+// The query, broadcast to every lane
+struct Query8 {
+    __m256 selfX, selfY, selfZ;
+    __m256 r1Sq, r2Sq, r3Sq, rLeadSq;
+    __m256i self;
+};
+struct Query16 {
+    __m512 selfX, selfY, selfZ;
+    __m512 r1Sq, r2Sq, r3Sq, rLeadSq;
+    __m512i self;
+};
+
+// Running sums over the neighbours, per lane
+struct Sums8 {
+    __m256 mx, my, mz, sx, sy, sz, ax, ay, az, lx, ly, lz, c1, c3;
+};
+struct Sums16 {
+    __m512 mx, my, mz, sx, sy, sz, ax, ay, az, lx, ly, lz, c1, c3;
+};
+
+// Adds up the 8 lanes of v
+AVX2 static inline float sum8(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+// Adds up the 16 lanes of v
+AVX512 static inline float sum16(__m512 v) {
+    __m512 hi = _mm512_shuffle_f32x4(v, v, _MM_SHUFFLE(3, 2, 3, 2));
+    return sum8(_mm256_add_ps(_mm512_castps512_ps256(v), _mm512_castps512_ps256(hi)));
+}
+
+AVX2 static inline void startQuery8(const NeighbourQuery *query, Query8 *q, Sums8 *s) {
+    q->selfX = _mm256_set1_ps(query->position[0]);
+    q->selfY = _mm256_set1_ps(query->position[1]);
+    q->selfZ = _mm256_set1_ps(query->position[2]);
+    q->r1Sq = _mm256_set1_ps(query->radiusSq[0]);
+    q->r2Sq = _mm256_set1_ps(query->radiusSq[1]);
+    q->r3Sq = _mm256_set1_ps(query->radiusSq[2]);
+    q->rLeadSq = _mm256_set1_ps(query->radiusSq[3]);
+    q->self = _mm256_set1_epi32(query->boid);
+    s->mx = s->my = s->mz = s->sx = s->sy = s->sz = _mm256_setzero_ps();
+    s->ax = s->ay = s->az = s->lx = s->ly = s->lz = _mm256_setzero_ps();
+    s->c1 = s->c3 = _mm256_setzero_ps();
+}
+
+AVX512 static inline void startQuery16(const NeighbourQuery *query, Query16 *q, Sums16 *s) {
+    q->selfX = _mm512_set1_ps(query->position[0]);
+    q->selfY = _mm512_set1_ps(query->position[1]);
+    q->selfZ = _mm512_set1_ps(query->position[2]);
+    q->r1Sq = _mm512_set1_ps(query->radiusSq[0]);
+    q->r2Sq = _mm512_set1_ps(query->radiusSq[1]);
+    q->r3Sq = _mm512_set1_ps(query->radiusSq[2]);
+    q->rLeadSq = _mm512_set1_ps(query->radiusSq[3]);
+    q->self = _mm512_set1_epi32(query->boid);
+    s->mx = s->my = s->mz = s->sx = s->sy = s->sz = _mm512_setzero_ps();
+    s->ax = s->ay = s->az = s->lx = s->ly = s->lz = _mm512_setzero_ps();
+    s->c1 = s->c3 = _mm512_setzero_ps();
+}
+
+AVX2 static inline void finishSums8(const Sums8 *s, NeighbourSums *sums) {
+    sums->centre[0] = sum8(s->mx); sums->centre[1] = sum8(s->my); sums->centre[2] = sum8(s->mz);
+    sums->separation[0] = sum8(s->sx); sums->separation[1] = sum8(s->sy); sums->separation[2] = sum8(s->sz);
+    sums->velocity[0] = sum8(s->ax); sums->velocity[1] = sum8(s->ay); sums->velocity[2] = sum8(s->az);
+    sums->leaderPull[0] = sum8(s->lx); sums->leaderPull[1] = sum8(s->ly); sums->leaderPull[2] = sum8(s->lz);
+    sums->n1 = sum8(s->c1);
+    sums->n3 = sum8(s->c3);
+}
+
+AVX512 static inline void finishSums16(const Sums16 *s, NeighbourSums *sums) {
+    sums->centre[0] = sum16(s->mx); sums->centre[1] = sum16(s->my); sums->centre[2] = sum16(s->mz);
+    sums->separation[0] = sum16(s->sx); sums->separation[1] = sum16(s->sy); sums->separation[2] = sum16(s->sz);
+    sums->velocity[0] = sum16(s->ax); sums->velocity[1] = sum16(s->ay); sums->velocity[2] = sum16(s->az);
+    sums->leaderPull[0] = sum16(s->lx); sums->leaderPull[1] = sum16(s->ly); sums->leaderPull[2] = sum16(s->lz);
+    sums->n1 = sum16(s->c1);
+    sums->n3 = sum16(s->c3);
+}
+
+// Tests 8 neighbours against the rule radii and adds them to the sums.
+// Lanes not in valid (past the end of a row or list) hold zeros; their
+// distance is made infinite so no radius test passes.
+AVX2 static inline void accumulate8(const Query8 *q, Sums8 *s, __m256i valid, __m256i ids,
+                                    __m256 x, __m256 y, __m256 z, __m256 vx, __m256 vy, __m256 vz, __m256 leader) {
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 dx = _mm256_sub_ps(x, q->selfX);
+    __m256 dy = _mm256_sub_ps(y, q->selfY);
+    __m256 dz = _mm256_sub_ps(z, q->selfZ);
+    __m256 distSq = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+    distSq = _mm256_blendv_ps(_mm256_set1_ps(INFINITY), distSq, _mm256_castsi256_ps(valid));
+
+    // centre of mass includes self
+    __m256 in1 = _mm256_cmp_ps(distSq, q->r1Sq, _CMP_LE_OQ);
+    s->mx = _mm256_add_ps(s->mx, _mm256_and_ps(in1, x));
+    s->my = _mm256_add_ps(s->my, _mm256_and_ps(in1, y));
+    s->mz = _mm256_add_ps(s->mz, _mm256_and_ps(in1, z));
+    s->c1 = _mm256_add_ps(s->c1, _mm256_and_ps(in1, one));
+
+    // self contributes a zero vector
+    __m256 in2 = _mm256_cmp_ps(distSq, q->r2Sq, _CMP_LE_OQ);
+    s->sx = _mm256_add_ps(s->sx, _mm256_and_ps(in2, dx));
+    s->sy = _mm256_add_ps(s->sy, _mm256_and_ps(in2, dy));
+    s->sz = _mm256_add_ps(s->sz, _mm256_and_ps(in2, dz));
+
+    // average not including self
+    __m256 isSelf = _mm256_castsi256_ps(_mm256_cmpeq_epi32(ids, q->self));
+    __m256 in3 = _mm256_andnot_ps(isSelf, _mm256_cmp_ps(distSq, q->r3Sq, _CMP_LE_OQ));
+    s->ax = _mm256_add_ps(s->ax, _mm256_and_ps(in3, vx));
+    s->ay = _mm256_add_ps(s->ay, _mm256_and_ps(in3, vy));
+    s->az = _mm256_add_ps(s->az, _mm256_and_ps(in3, vz));
+    s->c3 = _mm256_add_ps(s->c3, _mm256_and_ps(in3, one));
+
+    __m256 inLead = _mm256_and_ps(_mm256_cmp_ps(distSq, q->rLeadSq, _CMP_LE_OQ), leader);
+    s->lx = _mm256_fmadd_ps(inLead, dx, s->lx);
+    s->ly = _mm256_fmadd_ps(inLead, dy, s->ly);
+    s->lz = _mm256_fmadd_ps(inLead, dz, s->lz);
+}
+
+// As accumulate8(), but the radius tests give mask registers, which
+// both select what is added and keep out the lanes not in valid.
+AVX512 static inline void accumulate16(const Query16 *q, Sums16 *s, __mmask16 valid, __m512i ids,
+                                       __m512 x, __m512 y, __m512 z, __m512 vx, __m512 vy, __m512 vz, __m512 leader) {
+    const __m512 one = _mm512_set1_ps(1.0f);
+    __m512 dx = _mm512_sub_ps(x, q->selfX);
+    __m512 dy = _mm512_sub_ps(y, q->selfY);
+    __m512 dz = _mm512_sub_ps(z, q->selfZ);
+    __m512 distSq = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+
+    // centre of mass includes self
+    __mmask16 in1 = _mm512_mask_cmp_ps_mask(valid, distSq, q->r1Sq, _CMP_LE_OQ);
+    s->mx = _mm512_mask_add_ps(s->mx, in1, s->mx, x);
+    s->my = _mm512_mask_add_ps(s->my, in1, s->my, y);
+    s->mz = _mm512_mask_add_ps(s->mz, in1, s->mz, z);
+    s->c1 = _mm512_mask_add_ps(s->c1, in1, s->c1, one);
+
+    // self contributes a zero vector
+    __mmask16 in2 = _mm512_mask_cmp_ps_mask(valid, distSq, q->r2Sq, _CMP_LE_OQ);
+    s->sx = _mm512_mask_add_ps(s->sx, in2, s->sx, dx);
+    s->sy = _mm512_mask_add_ps(s->sy, in2, s->sy, dy);
+    s->sz = _mm512_mask_add_ps(s->sz, in2, s->sz, dz);
+
+    // average not including self
+    __mmask16 notSelf = _mm512_mask_cmpneq_epi32_mask(valid, ids, q->self);
+    __mmask16 in3 = _mm512_mask_cmp_ps_mask(notSelf, distSq, q->r3Sq, _CMP_LE_OQ);
+    s->ax = _mm512_mask_add_ps(s->ax, in3, s->ax, vx);
+    s->ay = _mm512_mask_add_ps(s->ay, in3, s->ay, vy);
+    s->az = _mm512_mask_add_ps(s->az, in3, s->az, vz);
+    s->c3 = _mm512_mask_add_ps(s->c3, in3, s->c3, one);
+
+    __mmask16 inLead = _mm512_mask_cmp_ps_mask(valid, distSq, q->rLeadSq, _CMP_LE_OQ);
+    __m512 lead = _mm512_maskz_mov_ps(inLead, leader);
+    s->lx = _mm512_fmadd_ps(lead, dx, s->lx);
+    s->ly = _mm512_fmadd_ps(lead, dy, s->ly);
+    s->lz = _mm512_fmadd_ps(lead, dz, s->lz);
+}
+
+// Lanes 0..n-1 of a 16 lane mask, n at most 16
+static inline __mmask16 firstLanes16(int n) {
+    return n >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << n) - 1);
+}
+
+AVX2 static int neighboursAVX2(const SpatialGrid *grid, const NeighbourQuery *query, NeighbourSums *sums) {
+    const float *px = grid->location.x, *py = grid->location.y, *pz = grid->location.z;
+    const float *vx = grid->velocity.x, *vy = grid->velocity.y, *vz = grid->velocity.z;
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    Query8 q;
+    Sums8 s;
+    int nVisited = 0;
+
+    startQuery8(query, &q, &s);
+    for (int cz = query->lo[2]; cz <= query->hi[2]; cz++) {
+        for (int cy = query->lo[1]; cy <= query->hi[1]; cy++) {
+            int rowCell = (cz*grid->dims[1] + cy)*grid->dims[0];
+            int first = grid->cellStart[rowCell + query->lo[0]];
+            int last = grid->cellStart[rowCell + query->hi[0] + 1];
+            nVisited += last - first;
+            for (int k = first; k < last; k += 8) {
+                __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(last - k), lanes);
+                accumulate8(&q, &s, valid, _mm256_maskload_epi32(grid->boids + k, valid),
+                            _mm256_maskload_ps(px + k, valid), _mm256_maskload_ps(py + k, valid),
+                            _mm256_maskload_ps(pz + k, valid), _mm256_maskload_ps(vx + k, valid),
+                            _mm256_maskload_ps(vy + k, valid), _mm256_maskload_ps(vz + k, valid),
+                            _mm256_maskload_ps(grid->leader + k, valid));
+            }
+        }
+    }
+    finishSums8(&s, sums);
+    return nVisited;
+}
+
+AVX512 static int neighboursAVX512(const SpatialGrid *grid, const NeighbourQuery *query, NeighbourSums *sums) {
+    const float *px = grid->location.x, *py = grid->location.y, *pz = grid->location.z;
+    const float *vx = grid->velocity.x, *vy = grid->velocity.y, *vz = grid->velocity.z;
+    Query16 q;
+    Sums16 s;
+    int nVisited = 0;
+
+    startQuery16(query, &q, &s);
+    for (int cz = query->lo[2]; cz <= query->hi[2]; cz++) {
+        for (int cy = query->lo[1]; cy <= query->hi[1]; cy++) {
+            int rowCell = (cz*grid->dims[1] + cy)*grid->dims[0];
+            int first = grid->cellStart[rowCell + query->lo[0]];
+            int last = grid->cellStart[rowCell + query->hi[0] + 1];
+            nVisited += last - first;
+            for (int k = first; k < last; k += 16) {
+                __mmask16 valid = firstLanes16(last - k);
+                accumulate16(&q, &s, valid, _mm512_maskz_loadu_epi32(valid, grid->boids + k),
+                             _mm512_maskz_loadu_ps(valid, px + k), _mm512_maskz_loadu_ps(valid, py + k),
+                             _mm512_maskz_loadu_ps(valid, pz + k), _mm512_maskz_loadu_ps(valid, vx + k),
+                             _mm512_maskz_loadu_ps(valid, vy + k), _mm512_maskz_loadu_ps(valid, vz + k),
+                             _mm512_maskz_loadu_ps(valid, grid->leader + k));
+            }
+        }
+    }
+    finishSums16(&s, sums);
+    return nVisited;
+}
+
+AVX2 static int listAVX2(const NeighbourLists *lists, const Vec3Array *location, const Vec3Array *velocity,
+                         const NeighbourQuery *query, NeighbourSums *sums) {
+    const int *list = lists->neighbours + lists->start[query->boid];
+    int n = lists->start[query->boid + 1] - lists->start[query->boid];
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 zero = _mm256_setzero_ps();
+    Query8 q;
+    Sums8 s;
+
+    startQuery8(query, &q, &s);
+    for (int j = 0; j < n; j += 8) {
+        __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(n - j), lanes);
+        __m256 mask = _mm256_castsi256_ps(valid);
+        __m256i ids = _mm256_maskload_epi32(list + j, valid);
+        accumulate8(&q, &s, valid, ids,
+                    _mm256_mask_i32gather_ps(zero, location->x, ids, mask, 4),
+                    _mm256_mask_i32gather_ps(zero, location->y, ids, mask, 4),
+                    _mm256_mask_i32gather_ps(zero, location->z, ids, mask, 4),
+                    _mm256_mask_i32gather_ps(zero, velocity->x, ids, mask, 4),
+                    _mm256_mask_i32gather_ps(zero, velocity->y, ids, mask, 4),
+                    _mm256_mask_i32gather_ps(zero, velocity->z, ids, mask, 4),
+                    _mm256_mask_i32gather_ps(zero, lists->leader, ids, mask, 4));
+    }
+    finishSums8(&s, sums);
+    return n;
+}
+
+AVX512 static int listAVX512(const NeighbourLists *lists, const Vec3Array *location, const Vec3Array *velocity,
+                             const NeighbourQuery *query, NeighbourSums *sums) {
+    const int *list = lists->neighbours + lists->start[query->boid];
+    int n = lists->start[query->boid + 1] - lists->start[query->boid];
+    const __m512 zero = _mm512_setzero_ps();
+    Query16 q;
+    Sums16 s;
+
+    startQuery16(query, &q, &s);
+    for (int j = 0; j < n; j += 16) {
+        __mmask16 valid = firstLanes16(n - j);
+        __m512i ids = _mm512_maskz_loadu_epi32(valid, list + j);
+        accumulate16(&q, &s, valid, ids,
+                     _mm512_mask_i32gather_ps(zero, valid, ids, location->x, 4),
+                     _mm512_mask_i32gather_ps(zero, valid, ids, location->y, 4),
+                     _mm512_mask_i32gather_ps(zero, valid, ids, location->z, 4),
+                     _mm512_mask_i32gather_ps(zero, valid, ids, velocity->x, 4),
+                     _mm512_mask_i32gather_ps(zero, valid, ids, velocity->y, 4),
+                     _mm512_mask_i32gather_ps(zero, valid, ids, velocity->z, 4),
+                     _mm512_mask_i32gather_ps(zero, valid, ids, lists->leader, 4));
+    }
+    finishSums16(&s, sums);
+    return n;
+}
+
+AVX2 static int pairsAVX2(const SpatialGrid *grid, const NeighbourQuery *query, int first, int last, PairSums *sums) {
+    return pairRun(grid, query, first, last, sums);
+}
+
+AVX512 static int pairsAVX512(const SpatialGrid *grid, const NeighbourQuery *query, int first, int last, PairSums *sums) {
+    return pairRun(grid, query, first, last, sums);
+}
+
+#endif
@@ -0,0 +1,70 @@
+/***********************************************************
+                     BoidsKernels.h
+
+	Kernels for the innermost loop of the boid update:
+	the radius tests and sums over the candidate
+	neighbours of one boid (see applyRules()). There is
+	a portable version and hand-written AVX2 and
+	AVX-512 versions testing 8 or 16 neighbours at a
+	time; the widest one the CPU supports is picked at
+	start-up. Each comes in two forms, reading the
+	neighbours from the grid or from neighbour lists.
+	The pair kernels, for accumulatePairs(), visit each
+	pair of boids once and add it to both boids' sums.
+	See BoidsKernels.cpp.
+***********************************************************/
+
+#ifndef BOIDS_KERNELS_H
+#define BOIDS_KERNELS_H
+
+#include "BoidsSim.h"
+
+// Instruction sets the neighbour kernel is written for, narrowest first
+enum {KERNEL_SCALAR, KERNEL_AVX2, KERNEL_AVX512, N_KERNELS};
+
+// What one boid needs to know about itself to visit its neighbours
+struct NeighbourQuery {
+    float position[3];
+    int boid;                       // Its index, so it can skip itself
+    float radiusSq[4];              // Squared r_rule1, r_rule2, r_rule3, r_ruleLeader
+    int lo[3], hi[3];               // Range of grid cells to visit
+};
+
+// Sums over the neighbours within each rule radius, see applyRules()
+struct NeighbourSums {
+    float centre[3];                // Positions within r_rule1, self included
+    float separation[3];            // Offsets within r_rule2
+    float velocity[3];              // Velocities within r_rule3, self excluded
+    float leaderPull[3];            // Offsets to leaders within r_ruleLeader
+    float n1, n3;                   // Boids counted in centre and velocity
+};
+
+// Visits the boids of grid in the query's cells, fills in sums, and
+// returns the number of boids visited
+typedef int (*NeighbourKernel)(const SpatialGrid *grid, const NeighbourQuery *query, NeighbourSums *sums);
+
+// As NeighbourKernel, but visits the boids on the query boid's
+// neighbour list, at their current location and velocity
+typedef int (*ListKernel)(const NeighbourLists *lists, const Vec3Array *location, const Vec3Array *velocity,
+                          const NeighbourQuery *query, NeighbourSums *sums);
+
+// Pairs the boid in grid slot query->boid with each of the boids in
+// slots first..last-1, which must not include it, and adds each pair
+// within a rule radius to the sums of both boids, by slot. The slots
+// may come before or after query->boid; it is up to the caller to pass
+// each unordered pair of boids exactly once, or it is counted twice.
+// Returns the number of pairs visited.
+typedef int (*PairKernel)(const SpatialGrid *grid, const NeighbourQuery *query, int first, int last, PairSums *sums);
+
+// *************** GLOBAL VARIABLES *************************
+extern const char *Kernel_Names[N_KERNELS];
+
+// ***********  FUNCTION HEADER DECLARATIONS ****************
+bool kernelSupported(int kernel);
+int bestKernel();
+int findKernel(const char *name);
+NeighbourKernel neighbourKernel(int kernel);
+ListKernel listKernel(int kernel);
+PairKernel pairKernel(int kernel);
+
+#endif
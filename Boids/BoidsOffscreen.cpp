@@ -0,0 +1,275 @@
+/***********************************************************
+                     BoidsOffscreen.cpp
+
+	Offscreen rendering with frame capture.
+
+	Used by the BoidsOffscreen build of the program (see
+	the Makefile), which renders flock videos on servers
+	with no display and no GPU. Instead of a GLUT window,
+	an OpenGL context is made with EGL on Mesa's
+	surfaceless platform, and WindowDisplay() draws into
+	a framebuffer object of the same size as the window
+	would have been.
+
+	Each captured frame is read back into a pixel buffer
+	object, so glReadPixels() does not wait for the frame
+	to finish drawing; the pixels are collected one frame
+	later, once the next frame has been drawn. They are
+	then handed to a writer thread, which saves them to
+	disk while the next frame is simulated and drawn.
+	Frames are written as binary PPM files named
+	<prefix>00000.ppm, <prefix>00001.ppm, and so on, which
+	ffmpeg and most image tools read directly.
+***********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES 1       // Declare the extension entry points
+#endif
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "BoidsOffscreen.h"
+
+#define N_PACK_BUFFERS 2            // Pixel buffers frames are read back into, in turn
+#define N_WRITE_BUFFERS 4           // Most frames waiting to be written at once
+
+// *************** GLOBAL VARIABLES *************************
+EGLDisplay Offscreen_Display;
+EGLContext Offscreen_Context;
+GLuint Offscreen_Framebuffer;
+GLuint Offscreen_Renderbuffers[2];  // Colour and depth
+int Offscreen_Size[2];              // Width and height of the frames
+const char *Frame_Prefix;           // Start of the name of every frame file
+GLuint Pack_Buffers[N_PACK_BUFFERS];
+int Pack_Frame[N_PACK_BUFFERS];     // Frame read into each pixel buffer, -1 if none
+int Pack_Next;                      // Pixel buffer the next frame is read into
+
+// Frames waiting for the writer thread, kept in a ring of
+// Write_Count buffers starting at Write_Head
+std::thread Writer_Thread;
+std::mutex Writer_Lock;
+std::condition_variable Writer_Wake;
+unsigned char *Write_Buffers[N_WRITE_BUFFERS];
+int Write_Frame[N_WRITE_BUFFERS];   // Frame held in each buffer
+int Write_Head;
+int Write_Count;
+bool Writer_Done;                   // No more frames are coming
+
+// ***********  FUNCTION HEADER DECLARATIONS ****************
+void collectFrame(int buffer);
+void writerThread();
+bool writeFrame(const unsigned char *pixels, int frame);
+
+// ******************** FUNCTIONS ************************
+
+// Makes an OpenGL context with no window, and a framebuffer object of
+// width x height pixels to draw into. Captured frames are written to
+// files starting with prefix. Returns false if there is no usable EGL
+// or OpenGL.
+bool initOffscreen(int width, int height, const char *prefix)
+{
+    // Prefer the surfaceless platform, which needs neither a display
+    // server nor a GPU, and fall back on the default one
+    Offscreen_Display = EGL_NO_DISPLAY;
+    const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (clientExtensions != NULL && strstr(clientExtensions, "EGL_MESA_platform_surfaceless") != NULL &&
+        getPlatformDisplay != NULL)
+    {
+        Offscreen_Display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (Offscreen_Display == EGL_NO_DISPLAY) Offscreen_Display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (Offscreen_Display == EGL_NO_DISPLAY || !eglInitialize(Offscreen_Display, NULL, NULL)) {
+        fprintf(stderr,"Unable to open an EGL display\n");
+        return false;
+    }
+
+    // Desktop OpenGL, as the scene uses the fixed-function pipeline.
+    // There is no surface to draw to, so any config will do.
+    const EGLint configAttributes[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+    EGLConfig config;
+    EGLint nConfigs;
+    if (!eglChooseConfig(Offscreen_Display, configAttributes, &config, 1, &nConfigs) || nConfigs < 1) {
+        config = (EGLConfig)0;      // EGL_NO_CONFIG_KHR
+    }
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        fprintf(stderr,"EGL does not support desktop OpenGL\n");
+        return false;
+    }
+    Offscreen_Context = eglCreateContext(Offscreen_Display, config, EGL_NO_CONTEXT, NULL);
+    if (Offscreen_Context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(Offscreen_Display, EGL_NO_SURFACE, EGL_NO_SURFACE, Offscreen_Context))
+    {
+        fprintf(stderr,"Unable to make an OpenGL context without a window\n");
+        return false;
+    }
+
+    // Colour and depth buffers, as the GLUT window has
+    Offscreen_Size[0] = width;
+    Offscreen_Size[1] = height;
+    glGenFramebuffers(1, &Offscreen_Framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, Offscreen_Framebuffer);
+    glGenRenderbuffers(2, Offscreen_Renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, Offscreen_Renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, Offscreen_Renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, Offscreen_Renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, Offscreen_Renderbuffers[1]);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr,"Unable to make a %dx%d framebuffer\n", width, height);
+        return false;
+    }
+
+    // Rows of RGB pixels, tightly packed
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    size_t frameBytes = (size_t)width*height*3;
+    glGenBuffers(N_PACK_BUFFERS, Pack_Buffers);
+    for (int b = 0; b < N_PACK_BUFFERS; b++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, Pack_Buffers[b]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes, NULL, GL_STREAM_READ);
+        Pack_Frame[b] = -1;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    Pack_Next = 0;
+
+    Frame_Prefix = prefix;
+    for (int b = 0; b < N_WRITE_BUFFERS; b++) {
+        Write_Buffers[b] = (unsigned char *)malloc(frameBytes);
+        if (Write_Buffers[b] == NULL) {
+            fprintf(stderr,"Unable to allocate the frame buffers\n");
+            return false;
+        }
+    }
+    Write_Head = 0;
+    Write_Count = 0;
+    Writer_Done = false;
+    Writer_Thread = std::thread(writerThread);
+    return true;
+}
+
+// Starts reading back the frame just drawn, and hands the one before
+// it, which has finished reading back by now, to the writer thread.
+// frame numbers the file it is written to.
+void captureFrame(int frame)
+{
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, Pack_Buffers[Pack_Next]);
+    glReadPixels(0, 0, Offscreen_Size[0], Offscreen_Size[1], GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    Pack_Frame[Pack_Next] = frame;
+    Pack_Next = (Pack_Next + 1) % N_PACK_BUFFERS;
+    collectFrame(Pack_Next);
+}
+
+// Writes out the frames still being read back, waits for the writer
+// thread to save every frame, and releases the context
+void finishOffscreen()
+{
+    for (int b = 0; b < N_PACK_BUFFERS; b++) {
+        collectFrame(Pack_Next);
+        Pack_Next = (Pack_Next + 1) % N_PACK_BUFFERS;
+    }
+    {
+        std::lock_guard<std::mutex> lock(Writer_Lock);
+        Writer_Done = true;
+    }
+    Writer_Wake.notify_all();
+    Writer_Thread.join();
+
+    for (int b = 0; b < N_WRITE_BUFFERS; b++) free(Write_Buffers[b]);
+    glDeleteBuffers(N_PACK_BUFFERS, Pack_Buffers);
+    glDeleteRenderbuffers(2, Offscreen_Renderbuffers);
+    glDeleteFramebuffers(1, &Offscreen_Framebuffer);
+    eglMakeCurrent(Offscreen_Display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(Offscreen_Display, Offscreen_Context);
+    eglTerminate(Offscreen_Display);
+}
+
+// Copies the frame read into pixel buffer b, if any, into a free write
+// buffer and queues it for the writer thread. Waits for the writer if
+// it has fallen N_WRITE_BUFFERS frames behind.
+void collectFrame(int b)
+{
+    if (Pack_Frame[b] < 0) return;
+
+    int slot;
+    {
+        std::unique_lock<std::mutex> lock(Writer_Lock);
+        Writer_Wake.wait(lock, []{ return Write_Count < N_WRITE_BUFFERS; });
+        slot = (Write_Head + Write_Count) % N_WRITE_BUFFERS;
+    }
+
+    // The writer does not touch the buffers past the end of the queue,
+    // so this one can be filled without holding the lock
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, Pack_Buffers[b]);
+    void *pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (pixels != NULL) {
+        memcpy(Write_Buffers[slot], pixels, (size_t)Offscreen_Size[0]*Offscreen_Size[1]*3);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        fprintf(stderr,"Unable to read back frame %d\n", Pack_Frame[b]);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if (pixels != NULL) {
+        std::lock_guard<std::mutex> lock(Writer_Lock);
+        Write_Frame[slot] = Pack_Frame[b];
+        Write_Count++;
+    }
+    Writer_Wake.notify_all();
+    Pack_Frame[b] = -1;
+}
+
+// Body of the writer thread. Saves the queued frames in order until
+// finishOffscreen() says there are no more.
+void writerThread()
+{
+    while (true)
+    {
+        int slot;
+        {
+            std::unique_lock<std::mutex> lock(Writer_Lock);
+            Writer_Wake.wait(lock, []{ return Write_Count > 0 || Writer_Done; });
+            if (Write_Count == 0) return;
+            slot = Write_Head;
+        }
+        writeFrame(Write_Buffers[slot], Write_Frame[slot]);
+        {
+            std::lock_guard<std::mutex> lock(Writer_Lock);
+            Write_Head = (Write_Head + 1) % N_WRITE_BUFFERS;
+            Write_Count--;
+        }
+        Writer_Wake.notify_all();
+    }
+}
+
+// Saves one frame of RGB pixels as a PPM image. OpenGL gives the rows
+// bottom to top, so they are written in reverse.
+bool writeFrame(const unsigned char *pixels, int frame)
+{
+    char name[1024];
+    snprintf(name, sizeof(name), "%s%05d.ppm", Frame_Prefix, frame);
+    FILE *f = fopen(name, "wb");
+    if (f == NULL) {
+        fprintf(stderr,"Unable to write frame %s\n", name);
+        return false;
+    }
+    int width = Offscreen_Size[0], height = Offscreen_Size[1];
+    fprintf(f, "P6\n%d %d\n255\n", width, height);
+    for (int y = height - 1; y >= 0; y--) {
+        fwrite(pixels + (size_t)y*width*3, 1, (size_t)width*3, f);
+    }
+    fclose(f);
+    return true;
+}
@@ -0,0 +1,19 @@
+/***********************************************************
+                     BoidsOffscreen.h
+
+	Offscreen rendering for machines without a display:
+	the scene is drawn into a framebuffer object in an
+	EGL context, and every frame is written to disk as a
+	PPM image by a writer thread.
+	See BoidsOffscreen.cpp.
+***********************************************************/
+
+#ifndef BOIDS_OFFSCREEN_H
+#define BOIDS_OFFSCREEN_H
+
+// ***********  FUNCTION HEADER DECLARATIONS ****************
+bool initOffscreen(int width, int height, const char *prefix);
+void captureFrame(int frame);
+void finishOffscreen();
+
+#endif
@@ -0,0 +1,161 @@
+/***********************************************************
+                     BoidsProfile.cpp
+
+	Per-phase frame profiler.
+
+	WindowDisplay() starts every frame with
+	beginProfileFrame() and wraps each of its phases in a
+	PhaseTimer. The times, in milliseconds, go into a ring
+	buffer holding the last PROFILE_FRAMES frames, which
+	drawProfilePanel() plots in the UI along with the
+	minimum, average and 99th percentile of each phase.
+	dumpProfile() writes the history out as CSV, one row
+	per frame, for offline analysis.
+
+	The draw phases time the CPU side of the GL calls
+	only. The GPU works through them asynchronously, so a
+	frame that is heavy for the GPU shows up as time spent
+	in glutSwapBuffers() (PHASE_SWAP).
+
+	The frame being drawn is left out of the history
+	until it is finished, so the plots and statistics
+	drawn by the UI, part way through a frame, only cover
+	whole frames.
+***********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <algorithm>
+#include <chrono>
+
+#include "imgui.h"
+#include "BoidsProfile.h"
+
+// *************** GLOBAL VARIABLES *************************
+const char *Phase_Names[N_PHASES] = {"tick", "scene", "prepare", "trails", "boids",
+                                     "ui", "swap", "frame"};
+float Profile_Times[PROFILE_FRAMES][N_PHASES];  // Ring buffer of phase times, in ms
+int Profile_Current;                // Slot of the frame being drawn
+int Profile_Count;                  // Slots in use, including the current one
+long Profile_Frames;                // Frames profiled so far
+
+// ******************** FUNCTIONS ************************
+
+PhaseTimer::PhaseTimer(int phase) : phase(phase), start(profileClock()) {}
+
+PhaseTimer::~PhaseTimer()
+{
+    recordPhase(phase, profileClock() - start);
+}
+
+// Finishes the last frame and starts timing a new one
+void beginProfileFrame()
+{
+    Profile_Current = (Profile_Current + 1) % PROFILE_FRAMES;
+    if (Profile_Count < PROFILE_FRAMES) Profile_Count++;
+    for (int p = 0; p < N_PHASES; p++) Profile_Times[Profile_Current][p] = 0;
+    Profile_Frames++;
+}
+
+// Adds seconds to a phase of the current frame
+void recordPhase(int phase, double seconds)
+{
+    Profile_Times[Profile_Current][phase] += seconds*1000;
+}
+
+// Returns the time in seconds from a high-resolution monotonic clock
+double profileClock()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Copies the times of a phase over the finished frames into times,
+// oldest first, and returns how many there are (at most
+// PROFILE_FRAMES - 1)
+int phaseHistory(int phase, float *times)
+{
+    int n = Profile_Count - 1;
+    int first = (Profile_Current - n + PROFILE_FRAMES) % PROFILE_FRAMES;
+    for (int f = 0; f < n; f++) times[f] = Profile_Times[(first + f) % PROFILE_FRAMES][phase];
+    return n;
+}
+
+// Works out the minimum, average and 99th percentile of n times
+void phaseStats(const float *times, int n, float *min, float *avg, float *p99)
+{
+    if (n == 0) {
+        *min = *avg = *p99 = 0;
+        return;
+    }
+    float sorted[PROFILE_FRAMES];
+    float sum = 0;
+    for (int f = 0; f < n; f++) {
+        sorted[f] = times[f];
+        sum += times[f];
+    }
+    int rank = (99*n + 99)/100 - 1;         // ceil(0.99 n) - 1
+    std::nth_element(sorted, sorted + rank, sorted + n);
+    *p99 = sorted[rank];
+    *min = *std::min_element(sorted, sorted + n);
+    *avg = sum/n;
+}
+
+// Draws a collapsible section of the current ImGui window with a plot
+// of every phase over the recent frames, its statistics, and a button
+// to save the history as CSV
+void drawProfilePanel()
+{
+    if (!ImGui::CollapsingHeader("Profile")) return;
+
+    float times[PROFILE_FRAMES];
+    for (int p = 0; p < N_PHASES; p++) {
+        int n = phaseHistory(p, times);
+        float min, avg, p99;
+        phaseStats(times, n, &min, &avg, &p99);
+        char overlay[64];
+        snprintf(overlay, sizeof(overlay), "min %.2f  avg %.2f  p99 %.2f ms", min, avg, p99);
+        ImGui::PlotLines(Phase_Names[p], times, n, 0, overlay, 0, FLT_MAX, ImVec2(0, 40));
+    }
+
+    static char status[128] = "";
+    if (ImGui::Button("Dump profile CSV")) {
+        if (dumpProfile("profile.csv")) {
+            snprintf(status, sizeof(status), "Wrote %d frames to profile.csv", Profile_Count - 1);
+        } else {
+            snprintf(status, sizeof(status), "Unable to write profile.csv");
+        }
+    }
+    if (status[0] != '\0') {
+        ImGui::SameLine();
+        ImGui::Text("%s", status);
+    }
+}
+
+// Writes the phase times of the finished frames to the named file as
+// CSV: a header row, then one row per frame, oldest first, holding
+// the frame's number and its time in each phase in ms. Returns false
+// if the file cannot be written.
+bool dumpProfile(const char *name)
+{
+    FILE *f = fopen(name, "w");
+    if (f == NULL) {
+        fprintf(stderr,"Unable to write the profile to %s\n", name);
+        return false;
+    }
+    fprintf(f, "frame");
+    for (int p = 0; p < N_PHASES; p++) fprintf(f, ",%s_ms", Phase_Names[p]);
+    fprintf(f, "\n");
+
+    int n = Profile_Count - 1;
+    int first = (Profile_Current - n + PROFILE_FRAMES) % PROFILE_FRAMES;
+    for (int r = 0; r < n; r++) {
+        float *times = Profile_Times[(first + r) % PROFILE_FRAMES];
+        fprintf(f, "%ld", Profile_Frames - 1 - n + r);
+        for (int p = 0; p < N_PHASES; p++) fprintf(f, ",%.4f", times[p]);
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    return true;
+}
@@ -0,0 +1,43 @@
+/***********************************************************
+                     BoidsProfile.h
+
+	Per-phase frame profiler: times the phases of every
+	frame drawn, keeps the times of the last
+	PROFILE_FRAMES frames, and shows them in the UI.
+	See BoidsProfile.cpp.
+***********************************************************/
+
+#ifndef BOIDS_PROFILE_H
+#define BOIDS_PROFILE_H
+
+#define PROFILE_FRAMES 300          // Frames of history kept
+
+// Phases of a frame. PHASE_TICK is the simulation thread's time for
+// the tick being drawn, the rest are parts of WindowDisplay(), and
+// PHASE_FRAME is the whole of it.
+enum {PHASE_TICK, PHASE_SCENE, PHASE_PREPARE, PHASE_TRAILS, PHASE_BOIDS,
+      PHASE_UI, PHASE_SWAP, PHASE_FRAME, N_PHASES};
+
+// Adds the time until the end of the enclosing scope to a phase of
+// the current frame:
+//   {
+//       PhaseTimer timer(PHASE_TRAILS);
+//       ...
+//   }
+struct PhaseTimer {
+    int phase;
+    double start;
+    PhaseTimer(int phase);
+    ~PhaseTimer();
+};
+
+// ***********  FUNCTION HEADER DECLARATIONS ****************
+void beginProfileFrame();
+void recordPhase(int phase, double seconds);
+double profileClock();
+int phaseHistory(int phase, float *times);
+void phaseStats(const float *times, int n, float *min, float *avg, float *p99);
+void drawProfilePanel();
+bool dumpProfile(const char *name);
+
+#endif
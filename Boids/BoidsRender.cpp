@@ -0,0 +1,781 @@
+/***********************************************************
+                     BoidsRender.cpp
+
+	Instanced rendering of the flock.
+
+	drawBoid() in Boids.cpp positions and animates every
+	part of every narwhal through the fixed-function matrix
+	stack, which costs a few dozen GL calls per boid. Here
+	the whole narwhal is instead built once as a single
+	mesh, in which each vertex records which part it
+	belongs to, and uploaded to a vertex buffer. Each frame
+	the transform of every boid (see computeBoidTransforms())
+	is uploaded as an instance buffer, and the whole flock
+	is drawn with one instanced draw call. The vertex
+	shader animates the fins and tail, which drawBoid()
+	does with glRotatef(), each boid at its own phase and
+	rate, so the only animation input besides the boid
+	data is a single clock uniform.
+
+	Boids outside the view are culled a grid cell at a
+	time, and distant boids are drawn with less detail:
+	as a single ellipsoid, and farther still as a point.
+
+	Only needs OpenGL 2.0 shaders (GLSL 1.20) and the
+	ARB_instanced_arrays and ARB_draw_instanced
+	extensions, so it runs on Mesa's llvmpipe as well as
+	on the legacy OpenGL context GLUT gives us on OS X.
+
+	The trails are kept in a single vertex buffer laid out
+	like Boid_Past_Locations in Boids.cpp: one slot of
+	nBoids points per past frame, used as a ring buffer.
+	Each frame only the slot holding the newest locations
+	is uploaded, and all trails are drawn as points with
+	one draw call, the shader working out each point's
+	colour from how old its slot is.
+***********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "BoidsRender.h"
+
+// Parts of the narwhal that move independently. Must match the
+// vertex shader below.
+enum {PART_FIXED, PART_LEFT_FIN, PART_RIGHT_FIN, PART_LOWER_BODY, PART_LEFT_TAIL, PART_RIGHT_TAIL};
+
+// One vertex of the narwhal mesh
+struct MeshVertex {
+    float position[3];              // In the frame of its part, see addSphere()
+    float normal[3];
+    float color[3];                 // Colour of the horn and eyes,
+    float tint;                     // or 1 to use the boid's colour instead
+    float part;                     // One of PART_*
+};
+
+// Vertex attributes. Generic attributes are used throughout, bound to
+// fixed locations so the buffers can be set up without looking them up.
+enum {ATTR_POSITION, ATTR_NORMAL, ATTR_COLOR, ATTR_TINT, ATTR_PART,
+      ATTR_BOID_ROW0, ATTR_BOID_ROW1, ATTR_BOID_ROW2, ATTR_BOID_COLOR, ATTR_BOID_SWIM, N_ATTRS};
+const char *Attr_Names[N_ATTRS] = {
+    "position", "normal", "color", "tint", "part",
+    "boidRow0", "boidRow1", "boidRow2", "boidColor", "boidSwim"
+};
+
+// Per-boid data that does not change from frame to frame, see
+// setInstanceLooks()
+struct BoidLook {
+    float color[3];
+    float swim[2];                  // Swim phase offset and rate, see drawBoid()
+};
+
+// Attributes of the trail points
+enum {TRAIL_ATTR_POSITION, TRAIL_ATTR_SLOT, N_TRAIL_ATTRS};
+const char *Trail_Attr_Names[N_TRAIL_ATTRS] = {"position", "slot"};
+
+// *************** GLOBAL VARIABLES *************************
+GLuint Fish_Program;                // Shader program drawing the narwhals
+GLuint Fish_Mesh_Buffer;            // MeshVertex for every vertex of a narwhal
+GLuint Fish_Transform_Buffer;       // 3x4 transform of every boid
+GLuint Fish_Look_Buffer;            // BoidLook for every boid
+GLint Fish_Clock_Uniform;
+int Fish_Lod_First[N_LODS];         // Part of the mesh drawn at each level of detail
+int Fish_Lod_Size[N_LODS];
+BoidLook *Fish_Looks;               // BoidLook of every boid
+float *Fish_Drawn_Transforms;       // Transforms and looks of the boids drawn this
+BoidLook *Fish_Drawn_Looks;         // frame, in the order they are drawn
+int Fish_Drawn_Capacity;
+SpatialGrid Cull_Grid;              // Grid of the boids being drawn, for culling
+int Fish_Mesh_Size;                 // Vertices in the mesh
+MeshVertex *Fish_Mesh;              // Mesh under construction
+int Fish_Mesh_Capacity;
+GLuint Trail_Program;               // Shader program drawing the trails
+GLuint Trail_Buffer;                // Past locations, see uploadTrails()
+GLuint Trail_Slot_Buffer;           // Slot of every point in Trail_Buffer
+GLint Trail_Head_Uniform;
+GLint Trail_Length_Uniform;
+int Trail_Points;                   // Points in Trail_Buffer
+
+// The vertex shader. Attributes are described above. The rotations
+// reproduce the glRotatef() calls in drawBoid(), angles in degrees.
+const char *Fish_Vertex_Source =
+"#version 120\n"
+"attribute vec3 position;\n"
+"attribute vec3 normal;\n"
+"attribute vec3 color;\n"
+"attribute float tint;\n"
+"attribute float part;\n"
+"attribute vec4 boidRow0;\n"
+"attribute vec4 boidRow1;\n"
+"attribute vec4 boidRow2;\n"
+"attribute vec3 boidColor;\n"
+"attribute vec2 boidSwim;\n"
+"uniform float swimClock;\n"
+"varying vec4 fragColor;\n"
+"\n"
+"mat3 rotateX(float angle) {\n"
+"    float c = cos(radians(angle)), s = sin(radians(angle));\n"
+"    return mat3(1.0, 0.0, 0.0,  0.0, c, s,  0.0, -s, c);\n"
+"}\n"
+"mat3 rotateY(float angle) {\n"
+"    float c = cos(radians(angle)), s = sin(radians(angle));\n"
+"    return mat3(c, 0.0, -s,  0.0, 1.0, 0.0,  s, 0.0, c);\n"
+"}\n"
+"\n"
+"void main() {\n"
+"    // Animate the part\n"
+"    float swimAngle = sin(boidSwim.x + boidSwim.y*swimClock);\n"
+"    float lowerBodyAngle = 10.0*swimAngle;\n"
+"    float tailAngle = lowerBodyAngle + 30.0*swimAngle;\n"
+"    mat3 joint = mat3(1.0);\n"
+"    vec3 offset = vec3(0.0);\n"
+"    if (part > 4.5) {\n"
+"        joint = rotateX(lowerBodyAngle)*rotateX(tailAngle);\n"
+"        offset = rotateX(lowerBodyAngle)*vec3(-0.5, 0.0, -3.0);\n"
+"    } else if (part > 3.5) {\n"
+"        joint = rotateX(lowerBodyAngle)*rotateX(tailAngle);\n"
+"        offset = rotateX(lowerBodyAngle)*vec3(0.5, 0.0, -3.0);\n"
+"    } else if (part > 2.5) {\n"
+"        joint = rotateX(lowerBodyAngle);\n"
+"    } else if (part > 1.5) {\n"
+"        joint = rotateY(50.0 + 20.0*swimAngle);\n"
+"        offset = vec3(-1.0, 0.0, 0.45);\n"
+"    } else if (part > 0.5) {\n"
+"        joint = rotateY(-50.0 - 20.0*swimAngle);\n"
+"        offset = vec3(1.0, 0.0, 0.45);\n"
+"    }\n"
+"\n"
+"    // Place the narwhal with the boid's transform\n"
+"    vec4 q = vec4(joint*position + offset, 1.0);\n"
+"    vec3 p = vec3(dot(boidRow0, q), dot(boidRow1, q), dot(boidRow2, q));\n"
+"    vec3 m = joint*normal;\n"
+"    vec3 n = vec3(dot(boidRow0.xyz, m), dot(boidRow1.xyz, m), dot(boidRow2.xyz, m));\n"
+"    n = normalize(gl_NormalMatrix*n);\n"
+"    gl_Position = gl_ModelViewProjectionMatrix*vec4(p, 1.0);\n"
+"\n"
+"    // Same lighting as the fixed-function pipeline set up in\n"
+"    // GL_Settings_Init(): LIGHT0 is a directional diffuse light,\n"
+"    // LIGHT1 and the light model add ambient light.\n"
+"    vec3 base = mix(color, boidColor, tint);\n"
+"    float diffuse = max(dot(n, normalize(gl_LightSource[0].position.xyz)), 0.0);\n"
+"    vec3 light = gl_LightModel.ambient.rgb + gl_LightSource[1].ambient.rgb\n"
+"               + diffuse*gl_LightSource[0].diffuse.rgb;\n"
+"    fragColor = vec4(base*light, 1.0);\n"
+"}\n";
+
+const char *Fish_Fragment_Source =
+"#version 120\n"
+"varying vec4 fragColor;\n"
+"void main() {\n"
+"    gl_FragColor = fragColor;\n"
+"}\n";
+
+// The trail shaders. A point in the newest slot (head) is bright red,
+// and the red fades out linearly to the oldest, as in drawTrajectory().
+const char *Trail_Vertex_Source =
+"#version 120\n"
+"attribute vec3 position;\n"
+"attribute float slot;\n"
+"uniform float head;\n"
+"uniform float trailLength;\n"
+"varying vec4 fragColor;\n"
+"void main() {\n"
+"    float age = mod(head - slot + trailLength, trailLength);\n"
+"    fragColor = vec4((trailLength - age)/trailLength, 0.0, 0.0, 1.0);\n"
+"    gl_Position = gl_ModelViewProjectionMatrix*vec4(position, 1.0);\n"
+"}\n";
+
+const char *Trail_Fragment_Source = Fish_Fragment_Source;
+
+// ***********  FUNCTION HEADER DECLARATIONS ****************
+void buildFishMesh();
+void addMeshVertex(int part, const float *color, float *position, float *normal);
+void addSphere(int part, const float *color, float radius, const float *scale,
+               float angleY, const float *offset);
+void addCone(int part, const float *color, float base, float height, const float *offset);
+void transformVertex(float *p, float *n, const float *scale, float angleY, const float *offset);
+void setAttribute(int attr, int size, int stride, size_t offset, int divisor);
+GLuint compileShader(const char *name, GLenum type, const char *source);
+
+// ******************** FUNCTIONS ************************
+
+// Checks for the extensions and builds the shader and the mesh.
+// Returns false if instanced rendering is not available, in which
+// case the boids have to be drawn with drawBoid().
+bool initInstancedRendering()
+{
+    const char *version = (const char *)glGetString(GL_VERSION);
+    if (version == NULL || atof(version) < 2.0 ||
+        !hasExtension("GL_ARB_instanced_arrays") || !hasExtension("GL_ARB_draw_instanced"))
+    {
+        fprintf(stderr,"Instanced rendering not supported, drawing boids one by one\n");
+        return false;
+    }
+
+    Fish_Program = buildProgram("narwhal", Fish_Vertex_Source, Fish_Fragment_Source,
+                                Attr_Names, N_ATTRS);
+    if (Fish_Program == 0) return false;
+    Fish_Clock_Uniform = glGetUniformLocation(Fish_Program, "swimClock");
+
+    buildFishMesh();
+    glGenBuffers(1, &Fish_Mesh_Buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, Fish_Mesh_Buffer);
+    glBufferData(GL_ARRAY_BUFFER, Fish_Mesh_Size*sizeof(MeshVertex), Fish_Mesh, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    free(Fish_Mesh);
+    Fish_Mesh = NULL;
+
+    glGenBuffers(1, &Fish_Transform_Buffer);
+    glGenBuffers(1, &Fish_Look_Buffer);
+    Fish_Looks = NULL;
+    Fish_Drawn_Transforms = NULL;
+    Fish_Drawn_Looks = NULL;
+    Fish_Drawn_Capacity = 0;
+    return true;
+}
+
+void freeInstancedRendering()
+{
+    glDeleteBuffers(1, &Fish_Mesh_Buffer);
+    glDeleteBuffers(1, &Fish_Transform_Buffer);
+    glDeleteBuffers(1, &Fish_Look_Buffer);
+    glDeleteProgram(Fish_Program);
+    free(Fish_Looks);
+    free(Fish_Drawn_Transforms);
+    free(Fish_Drawn_Looks);
+    freeVec3Array(&Cull_Grid.location);
+    freeVec3Array(&Cull_Grid.velocity);
+    free(Cull_Grid.leader);
+    free(Cull_Grid.boids);
+    free(Cull_Grid.boidCell);
+    free(Cull_Grid.cellStart);
+}
+
+// Sets the colour and swim phase offset and rate of every boid.
+// These do not change, so this is only needed once.
+void setInstanceLooks(Vec3Array *color, float *swimOffset, float *swimRate)
+{
+    free(Fish_Looks);
+    BoidLook *looks = Fish_Looks = (BoidLook *)malloc((size_t)nBoids*sizeof(BoidLook));
+    if (looks == NULL) {
+        fprintf(stderr,"Unable to allocate the colours of %d boids\n", nBoids);
+        exit(1);
+    }
+    for (int i=0; i<nBoids; i++) {
+        looks[i].color[0] = color->x[i];
+        looks[i].color[1] = color->y[i];
+        looks[i].color[2] = color->z[i];
+        looks[i].swim[0] = swimOffset[i];
+        looks[i].swim[1] = swimRate[i];
+    }
+}
+
+// Builds the transform placing every boid of the frame at its location,
+// turned to face along its velocity: the same transform drawBoid()
+// used to build with glTranslatef() and two glRotatef() calls, by way
+// of atan2() and asin(). transforms gets 12 floats per boid, a 3x4
+// matrix stored by rows whose columns are the boid's x, y and z axes
+// and its location.
+//
+// The z axis is the direction of travel and the x axis stays level
+// (the narwhal never rolls), so the basis comes straight from the
+// velocity v:
+//   z = v/|v|
+//   x = (-vy, vx, 0)/|vxy|
+//   y = z cross x
+// Boids moving straight up or down get +y as their x axis, as
+// atan2(0,0) gives, and boids at rest face along +x.
+void computeBoidTransforms(BoidFrame *frame, float *transforms)
+{
+    float *x = frame->location.x, *y = frame->location.y, *z = frame->location.z;
+    float *vx = frame->velocity.x, *vy = frame->velocity.y, *vz = frame->velocity.z;
+#pragma omp simd
+    for (int i=0; i<nBoids; i++)
+    {
+        float speedXY2 = vx[i]*vx[i] + vy[i]*vy[i];
+        float speed2 = speedXY2 + vz[i]*vz[i];
+        float invSpeedXY = 1.0f/sqrtf(speedXY2 + FLT_MIN);
+        float invSpeed = 1.0f/sqrtf(speed2 + FLT_MIN);
+
+        // Heading in the xy plane, and climb, as sines and cosines.
+        // The masks (1 or 0) pick the defaults for boids that are not
+        // moving without a branch, so the loop vectorizes.
+        float headingXY = speedXY2 > 0;
+        float heading = speed2 > 0;
+        float cosYaw = vx[i]*invSpeedXY + (1 - headingXY);
+        float sinYaw = vy[i]*invSpeedXY;
+        float cosClimb = speedXY2*invSpeedXY*invSpeed + (1 - heading);
+        float sinClimb = vz[i]*invSpeed;
+
+        float *m = transforms + (size_t)i*12;
+        m[0] = -sinYaw;   m[1] = -sinClimb*cosYaw;   m[2] = cosClimb*cosYaw;    m[3] = x[i];
+        m[4] = cosYaw;    m[5] = -sinClimb*sinYaw;   m[6] = cosClimb*sinYaw;    m[7] = y[i];
+        m[8] = 0;         m[9] = cosClimb;           m[10] = sinClimb;          m[11] = z[i];
+    }
+}
+
+// Draws the boids picked by cullBoids() at full detail and as
+// ellipsoids, with one draw call for each. transforms are the boids'
+// transforms from computeBoidTransforms(), clock the swim animation
+// clock (see swimPhase in Boids.cpp).
+void drawBoidsInstanced(float *transforms, float clock, BoidLODs *lods)
+{
+    int nDrawn = lods->count[LOD_FULL] + lods->count[LOD_ELLIPSOID];
+    if (nDrawn == 0) return;
+
+    // Gather the data of the boids being drawn, full detail first
+    if (nDrawn > Fish_Drawn_Capacity) {
+        free(Fish_Drawn_Transforms);
+        free(Fish_Drawn_Looks);
+        Fish_Drawn_Transforms = (float *)malloc((size_t)nBoids*12*sizeof(float));
+        Fish_Drawn_Looks = (BoidLook *)malloc((size_t)nBoids*sizeof(BoidLook));
+        if (Fish_Drawn_Transforms == NULL || Fish_Drawn_Looks == NULL) {
+            fprintf(stderr,"Unable to allocate the instance buffers for %d boids\n", nBoids);
+            exit(1);
+        }
+        Fish_Drawn_Capacity = nBoids;
+    }
+    int k = 0;
+    for (int lod = LOD_FULL; lod <= LOD_ELLIPSOID; lod++) {
+        for (int j = 0; j < lods->count[lod]; j++, k++) {
+            int i = lods->boids[lod][j];
+            memcpy(Fish_Drawn_Transforms + (size_t)k*12, transforms + (size_t)i*12, 12*sizeof(float));
+            Fish_Drawn_Looks[k] = Fish_Looks[i];
+        }
+    }
+
+    glUseProgram(Fish_Program);
+    glUniform1f(Fish_Clock_Uniform, clock);
+
+    glBindBuffer(GL_ARRAY_BUFFER, Fish_Mesh_Buffer);
+    setAttribute(ATTR_POSITION, 3, sizeof(MeshVertex), offsetof(MeshVertex, position), 0);
+    setAttribute(ATTR_NORMAL, 3, sizeof(MeshVertex), offsetof(MeshVertex, normal), 0);
+    setAttribute(ATTR_COLOR, 3, sizeof(MeshVertex), offsetof(MeshVertex, color), 0);
+    setAttribute(ATTR_TINT, 1, sizeof(MeshVertex), offsetof(MeshVertex, tint), 0);
+    setAttribute(ATTR_PART, 1, sizeof(MeshVertex), offsetof(MeshVertex, part), 0);
+
+    // Orphan last frame's instance data rather than wait for the GPU
+    // to finish with it
+    glBindBuffer(GL_ARRAY_BUFFER, Fish_Transform_Buffer);
+    glBufferData(GL_ARRAY_BUFFER, (size_t)nDrawn*12*sizeof(float), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, (size_t)nDrawn*12*sizeof(float), Fish_Drawn_Transforms);
+    glBindBuffer(GL_ARRAY_BUFFER, Fish_Look_Buffer);
+    glBufferData(GL_ARRAY_BUFFER, (size_t)nDrawn*sizeof(BoidLook), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, (size_t)nDrawn*sizeof(BoidLook), Fish_Drawn_Looks);
+
+    // There is no base instance to start a draw from, so each level of
+    // detail points the instance attributes at its own boids instead
+    int first = 0;
+    for (int lod = LOD_FULL; lod <= LOD_ELLIPSOID; lod++) {
+        if (lods->count[lod] == 0) continue;
+        size_t transform = (size_t)first*12*sizeof(float);
+        glBindBuffer(GL_ARRAY_BUFFER, Fish_Transform_Buffer);
+        setAttribute(ATTR_BOID_ROW0, 4, 12*sizeof(float), transform, 1);
+        setAttribute(ATTR_BOID_ROW1, 4, 12*sizeof(float), transform + 4*sizeof(float), 1);
+        setAttribute(ATTR_BOID_ROW2, 4, 12*sizeof(float), transform + 8*sizeof(float), 1);
+        size_t look = (size_t)first*sizeof(BoidLook);
+        glBindBuffer(GL_ARRAY_BUFFER, Fish_Look_Buffer);
+        setAttribute(ATTR_BOID_COLOR, 3, sizeof(BoidLook), look + offsetof(BoidLook, color), 1);
+        setAttribute(ATTR_BOID_SWIM, 2, sizeof(BoidLook), look + offsetof(BoidLook, swim), 1);
+
+        glDrawArraysInstancedARB(GL_TRIANGLES, Fish_Lod_First[lod], Fish_Lod_Size[lod], lods->count[lod]);
+        first += lods->count[lod];
+    }
+
+    for (int attr=0; attr<N_ATTRS; attr++) {
+        glVertexAttribDivisorARB(attr, 0);
+        glDisableVertexAttribArray(attr);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+}
+
+// Sorts the boids of the frame by how much detail to draw them with,
+// dropping those outside the view. The view is taken from the current
+// GL projection and modelview matrices. The boids are binned into a
+// grid and whole cells are tested against the view frustum, so the
+// cost depends on the number of cells, not boids. The boids in cells
+// that are (partly) in view are then drawn in full when nearer to the
+// eye than ellipsoidDistance, as points when farther than
+// pointDistance, and as ellipsoids in between.
+void cullBoids(BoidFrame *frame, BoidLODs *lods, float ellipsoidDistance, float pointDistance)
+{
+    if (nBoids > lods->capacity) {
+        for (int lod = 0; lod < N_LODS; lod++) {
+            free(lods->boids[lod]);
+            lods->boids[lod] = (int *)malloc(nBoids*sizeof(int));
+            if (lods->boids[lod] == NULL) {
+                fprintf(stderr,"Unable to allocate the draw lists for %d boids\n", nBoids);
+                exit(1);
+            }
+        }
+        lods->capacity = nBoids;
+    }
+    for (int lod = 0; lod < N_LODS; lod++) lods->count[lod] = 0;
+
+    // The frustum planes are sums and differences of the rows of the
+    // combined projection and modelview matrix (column-major in GL).
+    // A point p is inside plane k when plane[k].(p,1) >= 0.
+    GLfloat projection[16], modelview[16], clip[16];
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 4; r++) {
+            clip[c*4 + r] = 0;
+            for (int k = 0; k < 4; k++) clip[c*4 + r] += projection[k*4 + r]*modelview[c*4 + k];
+        }
+    }
+    float plane[6][4];
+    for (int k = 0; k < 6; k++) {
+        float sign = k % 2 ? -1 : 1;
+        for (int c = 0; c < 4; c++) plane[k][c] = clip[c*4 + 3] + sign*clip[c*4 + k/2];
+    }
+
+    // The eye is where the modelview matrix takes the origin from:
+    // eye = -R^T t for rotation R and translation t
+    float eye[3];
+    for (int d = 0; d < 3; d++) {
+        eye[d] = -(modelview[d*4 + 0]*modelview[12] + modelview[d*4 + 1]*modelview[13]
+                   + modelview[d*4 + 2]*modelview[14]);
+    }
+    float ellipsoid2 = ellipsoidDistance*ellipsoidDistance;
+    float point2 = pointDistance*pointDistance;
+
+    buildGrid(&Cull_Grid, &frame->location, NULL, CULL_CELL_SIZE);      // Positions only
+    SpatialGrid *grid = &Cull_Grid;
+    for (int cz = 0; cz < grid->dims[2]; cz++) {
+        for (int cy = 0; cy < grid->dims[1]; cy++) {
+            for (int cx = 0; cx < grid->dims[0]; cx++) {
+                int c = (cz*grid->dims[1] + cy)*grid->dims[0] + cx;
+                if (grid->cellStart[c] == grid->cellStart[c + 1]) continue;
+
+                // Bounds of the cell, grown so boids at its edge are kept
+                // whole. The edge cells also hold boids clamped into them.
+                float lo[3], hi[3];
+                int cell[3] = {cx, cy, cz};
+                for (int d = 0; d < 3; d++) {
+                    lo[d] = grid->origin[d] + cell[d]*grid->cellSize - BOID_RADIUS;
+                    hi[d] = lo[d] + grid->cellSize + 2*BOID_RADIUS;
+                }
+
+                // The cell is out of view if its corner farthest along a
+                // plane's normal is outside that plane
+                bool visible = true;
+                for (int k = 0; k < 6 && visible; k++) {
+                    float dist = plane[k][3];
+                    for (int d = 0; d < 3; d++) dist += plane[k][d]*(plane[k][d] > 0 ? hi[d] : lo[d]);
+                    visible = dist >= 0;
+                }
+                if (!visible) continue;
+
+                for (int j = grid->cellStart[c]; j < grid->cellStart[c + 1]; j++) {
+                    float dist2 = distanceSq(eye, grid->location.x[j], grid->location.y[j], grid->location.z[j]);
+                    int lod = dist2 < ellipsoid2 ? LOD_FULL : dist2 < point2 ? LOD_ELLIPSOID : LOD_POINT;
+                    lods->boids[lod][lods->count[lod]++] = grid->boids[j];
+                }
+            }
+        }
+    }
+}
+
+// Builds the trail shader. Returns false if shaders are not
+// available, in which case the trails have to be drawn with
+// drawTrajectory().
+bool initTrailRendering()
+{
+    const char *version = (const char *)glGetString(GL_VERSION);
+    if (version == NULL || atof(version) < 2.0) return false;
+
+    Trail_Program = buildProgram("trail", Trail_Vertex_Source, Trail_Fragment_Source,
+                                 Trail_Attr_Names, N_TRAIL_ATTRS);
+    if (Trail_Program == 0) return false;
+    Trail_Head_Uniform = glGetUniformLocation(Trail_Program, "head");
+    Trail_Length_Uniform = glGetUniformLocation(Trail_Program, "trailLength");
+
+    glGenBuffers(1, &Trail_Buffer);
+    glGenBuffers(1, &Trail_Slot_Buffer);
+    Trail_Points = 0;
+    return true;
+}
+
+void freeTrailRendering()
+{
+    glDeleteBuffers(1, &Trail_Buffer);
+    glDeleteBuffers(1, &Trail_Slot_Buffer);
+    glDeleteProgram(Trail_Program);
+}
+
+// Uploads all of the trails, length slots of nBoids points each.
+// Needed whenever the trails are reset or change length.
+void uploadTrails(float *pastLocations, int length)
+{
+    Trail_Points = length*nBoids;
+    glBindBuffer(GL_ARRAY_BUFFER, Trail_Buffer);
+    glBufferData(GL_ARRAY_BUFFER, (size_t)Trail_Points*3*sizeof(float), pastLocations, GL_DYNAMIC_DRAW);
+
+    // The slot of a point never changes, only which slot is the head
+    float *slots = (float *)malloc((size_t)Trail_Points*sizeof(float));
+    if (slots == NULL) {
+        fprintf(stderr,"Unable to allocate trails of length %d\n", length);
+        exit(1);
+    }
+    for (int j=0; j<length; j++) {
+        for (int i=0; i<nBoids; i++) slots[(size_t)j*nBoids + i] = j;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, Trail_Slot_Buffer);
+    glBufferData(GL_ARRAY_BUFFER, (size_t)Trail_Points*sizeof(float), slots, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    free(slots);
+}
+
+// Uploads the one slot of the trails that changed
+void updateTrail(float *pastLocations, int slot)
+{
+    size_t offset = (size_t)slot*nBoids*3;
+    glBindBuffer(GL_ARRAY_BUFFER, Trail_Buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, offset*sizeof(float), (size_t)nBoids*3*sizeof(float),
+                    pastLocations + offset);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Draws the trails of every boid with a single draw call
+void drawTrails(int head, int length)
+{
+    glUseProgram(Trail_Program);
+    glUniform1f(Trail_Head_Uniform, head);
+    glUniform1f(Trail_Length_Uniform, length);
+
+    glBindBuffer(GL_ARRAY_BUFFER, Trail_Buffer);
+    setAttribute(TRAIL_ATTR_POSITION, 3, 3*sizeof(float), 0, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, Trail_Slot_Buffer);
+    setAttribute(TRAIL_ATTR_SLOT, 1, sizeof(float), 0, 0);
+
+    glDrawArrays(GL_POINTS, 0, Trail_Points);
+
+    glDisableVertexAttribArray(TRAIL_ATTR_POSITION);
+    glDisableVertexAttribArray(TRAIL_ATTR_SLOT);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+}
+
+// Points attribute attr at the bound buffer. divisor is 0 for
+// per-vertex data and 1 for per-instance data; drawBoidsInstanced()
+// puts the divisors back to 0 when it is done.
+void setAttribute(int attr, int size, int stride, size_t offset, int divisor)
+{
+    glEnableVertexAttribArray(attr);
+    glVertexAttribPointer(attr, size, GL_FLOAT, GL_FALSE, stride, (const GLvoid *)offset);
+    if (divisor) glVertexAttribDivisorARB(attr, divisor);
+}
+
+// Builds the narwhal drawn by drawBoid() as one mesh. The shapes and
+// their fixed transforms are the same; the animated rotations are
+// left to the vertex shader, which picks them by part.
+void buildFishMesh()
+{
+    const float horn[3] = {0.7, 0.7, 0.55};
+    const float eye[3] = {0.5, 0.85, 0.85};
+    const float none[3] = {0, 0, 0};
+
+    Fish_Mesh_Size = 0;
+    Fish_Mesh_Capacity = 0;
+    Fish_Mesh = NULL;
+
+    // Upper body, horn and eyes
+    const float bodyScale[3] = {1, 1, 2};
+    addSphere(PART_FIXED, NULL, 1, bodyScale, 0, none);
+    const float hornOffset[3] = {0, -0.15, 1.8};
+    addCone(PART_FIXED, horn, 0.15, 1.8, hornOffset);
+    const float unit[3] = {1, 1, 1};
+    const float leftEye[3] = {-0.3, 0.2, 1.7};
+    const float rightEye[3] = {0.3, 0.2, 1.7};
+    addSphere(PART_FIXED, eye, 0.2, unit, 0, leftEye);
+    addSphere(PART_FIXED, eye, 0.2, unit, 0, rightEye);
+
+    // Fins, about their hinges
+    const float finScale[3] = {0.2, 1, 2};
+    const float finOffset[3] = {0, 0, -0.3};
+    addSphere(PART_LEFT_FIN, NULL, 0.35, finScale, 0, finOffset);
+    addSphere(PART_RIGHT_FIN, NULL, 0.35, finScale, 0, finOffset);
+
+    // Lower body and the two halves of the tail
+    const float lowerScale[3] = {1, 1, 2.5};
+    const float lowerOffset[3] = {0, 0, -1.2};
+    addSphere(PART_LOWER_BODY, NULL, 0.8, lowerScale, 0, lowerOffset);
+    const float tailScale[3] = {1.2, 0.5, 1.5};
+    addSphere(PART_LEFT_TAIL, NULL, 0.5, tailScale, -25, none);
+    addSphere(PART_RIGHT_TAIL, NULL, 0.5, tailScale, 25, none);
+    Fish_Lod_First[LOD_FULL] = 0;
+    Fish_Lod_Size[LOD_FULL] = Fish_Mesh_Size;
+
+    // A single ellipsoid covering the body, for distant boids
+    const float ellipsoidScale[3] = {1, 1, 2.8};
+    const float ellipsoidOffset[3] = {0, 0, -0.6};
+    Fish_Lod_First[LOD_ELLIPSOID] = Fish_Mesh_Size;
+    addSphere(PART_FIXED, NULL, 1, ellipsoidScale, 0, ellipsoidOffset);
+    Fish_Lod_Size[LOD_ELLIPSOID] = Fish_Mesh_Size - Fish_Lod_First[LOD_ELLIPSOID];
+}
+
+// Appends a vertex to the mesh. A NULL color means the vertex takes
+// the boid's colour.
+void addMeshVertex(int part, const float *color, float *position, float *normal)
+{
+    if (Fish_Mesh_Size == Fish_Mesh_Capacity) {
+        Fish_Mesh_Capacity = Fish_Mesh_Capacity ? 2*Fish_Mesh_Capacity : 256;
+        Fish_Mesh = (MeshVertex *)realloc(Fish_Mesh, Fish_Mesh_Capacity*sizeof(MeshVertex));
+        if (Fish_Mesh == NULL) {
+            fprintf(stderr,"Unable to allocate the narwhal mesh\n");
+            exit(1);
+        }
+    }
+    MeshVertex *v = Fish_Mesh + Fish_Mesh_Size++;
+    memcpy(v->position, position, sizeof(v->position));
+    memcpy(v->normal, normal, sizeof(v->normal));
+    for (int k=0; k<3; k++) v->color[k] = color ? color[k] : 0;
+    v->tint = color ? 0 : 1;
+    v->part = part;
+}
+
+// Applies a part's fixed transform to a point and its normal: scale,
+// then rotate about y by angleY degrees, then translate by offset.
+void transformVertex(float *p, float *n, const float *scale, float angleY, const float *offset)
+{
+    float c = cos(angleY*M_PI/180.0), s = sin(angleY*M_PI/180.0);
+    float sp[3], sn[3];
+    for (int k=0; k<3; k++) {
+        sp[k] = p[k]*scale[k];
+        sn[k] = n[k]/scale[k];      // Normals take the inverse scale
+    }
+    float len = sqrt(lengthSq(sn[0], sn[1], sn[2]));
+    for (int k=0; k<3; k++) sn[k] /= len;
+    p[0] = c*sp[0] + s*sp[2] + offset[0];
+    p[1] = sp[1] + offset[1];
+    p[2] = -s*sp[0] + c*sp[2] + offset[2];
+    n[0] = c*sn[0] + s*sn[2];
+    n[1] = sn[1];
+    n[2] = -s*sn[0] + c*sn[2];
+}
+
+// Adds a sphere of the given radius, tessellated like
+// gluSphere(quad, radius, 4, 4), with a fixed transform.
+void addSphere(int part, const float *color, float radius, const float *scale,
+               float angleY, const float *offset)
+{
+    const int slices = 4, stacks = 4;
+    for (int j=0; j<stacks; j++) {
+        for (int i=0; i<slices; i++) {
+            // Corners of this quad, as (stack, slice)
+            int corners[6][2] = {{j,i}, {j+1,i}, {j+1,i+1}, {j,i}, {j+1,i+1}, {j,i+1}};
+            for (int c=0; c<6; c++) {
+                float rho = M_PI*corners[c][0]/stacks;
+                float theta = 2*M_PI*corners[c][1]/slices;
+                float n[3] = {-sinf(theta)*sinf(rho), cosf(theta)*sinf(rho), cosf(rho)};
+                float p[3] = {n[0]*radius, n[1]*radius, n[2]*radius};
+                transformVertex(p, n, scale, angleY, offset);
+                addMeshVertex(part, color, p, n);
+            }
+        }
+    }
+}
+
+// Adds a cone along +z with its base at offset, like
+// glutSolidCone(base, height, 4, 4).
+void addCone(int part, const float *color, float base, float height, const float *offset)
+{
+    const int slices = 4;
+    const float unit[3] = {1, 1, 1};
+    float side = sqrt(height*height + base*base);
+    for (int i=0; i<slices; i++) {
+        float t0 = 2*M_PI*i/slices, t1 = 2*M_PI*(i+1)/slices;
+
+        // Side
+        float p0[3] = {base*cosf(t0), base*sinf(t0), 0};
+        float n0[3] = {height*cosf(t0)/side, height*sinf(t0)/side, base/side};
+        float p1[3] = {base*cosf(t1), base*sinf(t1), 0};
+        float n1[3] = {height*cosf(t1)/side, height*sinf(t1)/side, base/side};
+        float pa[3] = {0, 0, height};
+        float na[3] = {height*cosf(0.5*(t0+t1))/side, height*sinf(0.5*(t0+t1))/side, base/side};
+        transformVertex(p0, n0, unit, 0, offset);
+        transformVertex(p1, n1, unit, 0, offset);
+        transformVertex(pa, na, unit, 0, offset);
+        addMeshVertex(part, color, p0, n0);
+        addMeshVertex(part, color, p1, n1);
+        addMeshVertex(part, color, pa, na);
+
+        // Base
+        float b0[3] = {base*cosf(t0), base*sinf(t0), 0};
+        float b1[3] = {base*cosf(t1), base*sinf(t1), 0};
+        float bc[3] = {0, 0, 0};
+        float nb0[3] = {0, 0, -1}, nb1[3] = {0, 0, -1}, nbc[3] = {0, 0, -1};
+        transformVertex(b0, nb0, unit, 0, offset);
+        transformVertex(b1, nb1, unit, 0, offset);
+        transformVertex(bc, nbc, unit, 0, offset);
+        addMeshVertex(part, color, b1, nb1);
+        addMeshVertex(part, color, b0, nb0);
+        addMeshVertex(part, color, bc, nbc);
+    }
+}
+
+// Returns true if the current context supports the named extension
+bool hasExtension(const char *name)
+{
+    const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+    if (extensions == NULL) return false;
+    int len = strlen(name);
+    for (const char *p = strstr(extensions, name); p; p = strstr(p + len, name)) {
+        if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) return true;
+    }
+    return false;
+}
+
+// Compiles one shader stage. Prints the log and returns 0 on failure.
+GLuint compileShader(const char *name, GLenum type, const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    GLint ok;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[4096];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr,"Unable to compile the %s %s shader:\n%s\n", name,
+                type == GL_VERTEX_SHADER ? "vertex" : "fragment", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// Compiles and links a shader program, binding attributes[i] to
+// generic attribute i. Prints the log and returns 0 on failure.
+GLuint buildProgram(const char *name, const char *vertexSource, const char *fragmentSource,
+                    const char **attributes, int nAttributes)
+{
+    GLuint vertex = compileShader(name, GL_VERTEX_SHADER, vertexSource);
+    GLuint fragment = compileShader(name, GL_FRAGMENT_SHADER, fragmentSource);
+    if (vertex == 0 || fragment == 0) return 0;
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+    for (int i=0; i<nAttributes; i++) glBindAttribLocation(program, i, attributes[i]);
+    glLinkProgram(program);
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+
+    GLint ok;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char log[4096];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr,"Unable to link the %s shader program:\n%s\n", name, log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
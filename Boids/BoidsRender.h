@@ -0,0 +1,64 @@
+/***********************************************************
+                     BoidsRender.h
+
+	Instanced rendering of the flock: the narwhal mesh
+	is uploaded once, and every boid is drawn from it in
+	a single draw call, with the per-boid data in an
+	instance buffer. The trails are likewise kept in one
+	vertex buffer and drawn with one call. cullBoids()
+	drops boids outside the view and picks how much
+	detail to draw the rest with.
+	See BoidsRender.cpp.
+***********************************************************/
+
+#ifndef BOIDS_RENDER_H
+#define BOIDS_RENDER_H
+
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES 1       // Declare the extension entry points
+#endif
+#ifdef __APPLE__
+#include <OpenGL/OpenGL.h>
+#include <OpenGL/glext.h>
+#include <GLUT/GLUT.h>
+#else
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <GL/glut.h>
+#endif
+
+#include "BoidsSim.h"
+
+#define CULL_CELL_SIZE 16           // Edge of the grid cells used for frustum culling
+#define BOID_RADIUS 4               // Bounding radius of a narwhal, horn to tail
+
+// Levels of detail a boid can be drawn at, from nearest to farthest
+enum {LOD_FULL, LOD_ELLIPSOID, LOD_POINT, N_LODS};
+
+// The boids left to draw after culling, sorted by level of detail.
+// Filled by cullBoids().
+struct BoidLODs {
+    int *boids[N_LODS];             // Indices of the boids drawn at each level
+    int count[N_LODS];
+    int capacity;                   // Allocated length of each list
+};
+
+// ***********  FUNCTION HEADER DECLARATIONS ****************
+bool initInstancedRendering();
+void freeInstancedRendering();
+void setInstanceLooks(Vec3Array *color, float *swimOffset, float *swimRate);
+void computeBoidTransforms(BoidFrame *frame, float *transforms);
+void drawBoidsInstanced(float *transforms, float clock, BoidLODs *lods);
+void cullBoids(BoidFrame *frame, BoidLODs *lods, float ellipsoidDistance, float pointDistance);
+bool initTrailRendering();
+void freeTrailRendering();
+void uploadTrails(float *pastLocations, int length);
+void updateTrail(float *pastLocations, int slot);
+void drawTrails(int head, int length);
+
+// General helper functions
+bool hasExtension(const char *name);
+GLuint buildProgram(const char *name, const char *vertexSource, const char *fragmentSource,
+                    const char **attributes, int nAttributes);
+
+#endif
@@ -0,0 +1,101 @@
+/***********************************************************
+                     BoidsScene.cpp
+
+	Static geometry for the scene furniture.
+
+	The furniture used to be sent vertex by vertex with
+	glBegin()/glEnd() every frame. Instead, each piece is
+	built once by initStaticGeometry() and kept in its own
+	vertex buffer along with how to draw it, so drawing
+	it costs one draw call whatever its size.
+
+	To add a piece, add it to the enum in BoidsScene.h
+	and build it in initStaticGeometry() with
+	addStaticPiece().
+***********************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "BoidsScene.h"
+
+// A piece of furniture, uploaded once and drawn with one call
+struct StaticPiece {
+    GLuint buffer;                  // (x,y,z) of every vertex
+    GLenum mode;                    // Primitive the vertices make up
+    int count;                      // Number of vertices
+    float color[4];
+};
+
+// *************** GLOBAL VARIABLES *************************
+StaticPiece Scene_Pieces[N_SCENE_PIECES];
+
+// ***********  FUNCTION HEADER DECLARATIONS ****************
+void addStaticPiece(int piece, GLenum mode, const float *vertices, int count, const float *color);
+
+// ******************** FUNCTIONS ************************
+
+// Builds every piece of furniture and uploads it. Needs a GL context,
+// so call it once the window is up.
+void initStaticGeometry()
+{
+    // The box bounding the viewing area, as its 12 edges
+    const float h = BOX_HALF_SIZE;
+    const float boxColor[4] = {.95, .95, .95, .95};
+    float box[24*3];
+    int n = 0;
+    for (int d = 0; d < 3; d++) {
+        // The 4 edges along axis d, one from each corner of the face
+        // at -h along that axis
+        int u = (d + 1) % 3, v = (d + 2) % 3;
+        for (int corner = 0; corner < 4; corner++) {
+            for (int end = 0; end < 2; end++) {
+                float *p = box + 3*n++;
+                p[d] = end ? h : -h;
+                p[u] = corner & 1 ? h : -h;
+                p[v] = corner & 2 ? h : -h;
+            }
+        }
+    }
+    addStaticPiece(SCENE_BOX, GL_LINES, box, n, boxColor);
+}
+
+void freeStaticGeometry()
+{
+    for (int piece = 0; piece < N_SCENE_PIECES; piece++) {
+        glDeleteBuffers(1, &Scene_Pieces[piece].buffer);
+    }
+}
+
+// Draws all of the furniture
+void drawStaticGeometry()
+{
+    for (int piece = 0; piece < N_SCENE_PIECES; piece++) drawStaticPiece(piece);
+}
+
+// Draws one piece of furniture with the current modelview matrix
+void drawStaticPiece(int piece)
+{
+    StaticPiece *p = &Scene_Pieces[piece];
+    glColor4fv(p->color);
+    glBindBuffer(GL_ARRAY_BUFFER, p->buffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, NULL);
+    glDrawArrays(p->mode, 0, p->count);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Uploads count vertices, (x,y,z) each, as the given piece, to be
+// drawn as mode primitives in the given colour (RGBA)
+void addStaticPiece(int piece, GLenum mode, const float *vertices, int count, const float *color)
+{
+    StaticPiece *p = &Scene_Pieces[piece];
+    glGenBuffers(1, &p->buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, p->buffer);
+    glBufferData(GL_ARRAY_BUFFER, (size_t)count*3*sizeof(float), vertices, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    p->mode = mode;
+    p->count = count;
+    for (int c = 0; c < 4; c++) p->color[c] = color[c];
+}
@@ -0,0 +1,37 @@
+/***********************************************************
+                     BoidsScene.h
+
+	Static geometry for the scene furniture: everything
+	drawn around the flock that never changes, such as
+	the box bounding the viewing area. Each piece is
+	uploaded to a vertex buffer once and drawn with a
+	single call.
+	See BoidsScene.cpp.
+***********************************************************/
+
+#ifndef BOIDS_SCENE_H
+#define BOIDS_SCENE_H
+
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES 1       // Declare the extension entry points
+#endif
+#ifdef __APPLE__
+#include <OpenGL/OpenGL.h>
+#include <OpenGL/glext.h>
+#else
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
+
+#define BOX_HALF_SIZE 50            // Half the edge of the box bounding the viewing area
+
+// The pieces of scene furniture
+enum {SCENE_BOX, N_SCENE_PIECES};
+
+// ***********  FUNCTION HEADER DECLARATIONS ****************
+void initStaticGeometry();
+void freeStaticGeometry();
+void drawStaticGeometry();
+void drawStaticPiece(int piece);
+
+#endif
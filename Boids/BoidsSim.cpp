@@ -0,0 +1,1411 @@
+/***********************************************************
+                     BoidsSim.cpp
+
+	The boid simulation: flock state, the neighbour
+	grid, the update rules, and the thread that
+	advances the flock and hands frames to the
+	renderer.
+
+	Nothing in here uses OpenGL, so the same code
+	drives both the interactive program (Boids.cpp)
+	and the headless benchmark (BoidsBench.cpp).
+***********************************************************/
+
+/* Standard C libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* C++ threading, used to run the simulation on its own thread */
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <stdint.h>
+
+#include "BoidsSim.h"
+#include "BoidsKernels.h"
+
+// *************** GLOBAL VARIABLES *************************
+int nBoids;				// Number of boids to dispay
+Vec3Array Boid_Location;		// Boid position & velocity data
+Vec3Array Boid_Velocity;		// for the current frame
+Vec3Array Next_Location;		// Position & velocity being computed
+Vec3Array Next_Velocity;		// for the next frame, see swapBoidState()
+float *modelVertices;               // Imported model vertices
+int *Boid_Model_Vertex;             // Assigned model vertex for boid i
+int *Boid_Id;                       // Stable ID of the boid at index i, see reorderBoids()
+bool Boid_Permuted;                 // Whether Boid_Id is anything but the identity
+int n_vertices;                     // Number of model vertices
+int nLeaders;						// How many leaders there are
+int leaders[5];						// IDs of the leaders (see Boid_Id), fixed at setup
+SpatialGrid Boid_Grid;              // Rebuilt once per tick, or with the lists
+NeighbourLists Boid_Lists;          // Rebuilt when boids have moved far enough
+int **List_Scratch;                 // Each thread's list being filled, see buildNeighbourLists()
+int List_Scratch_Threads;           // Number of List_Scratch
+int List_Scratch_Capacity;          // Allocated length of each
+PairSums Boid_Pair_Sums;            // Neighbour sums of each boid, see accumulatePairs()
+PairSums *Pair_Thread_Sums;         // Each thread's share of them, by grid slot
+int Pair_Threads;                   // Number of Pair_Thread_Sums
+int Pair_Capacity;                  // Allocated length of each sum
+
+// Triple buffer shared with the renderer, see BoidFrame
+#define FRAME_INDEX 3               // Frame_Shared bits holding the frame index
+#define FRAME_NEW 4                 // Set while the shared frame is unseen
+BoidFrame Frames[3];
+std::atomic<int> Frame_Shared;      // Shared frame, plus FRAME_NEW
+int Frame_Writing;                  // Frame being filled (simulation thread)
+int Frame_Reading;                  // Frame being drawn (render thread)
+
+BoidParams Sim_Params;              // Owned by the simulation thread
+BoidParams Pending_Params;          // Latest values from the UI
+std::mutex Params_Lock;             // Guards Pending_Params
+std::thread Sim_Thread;
+std::atomic<bool> Sim_Running;
+long Sim_Tick;                      // Number of ticks simulated so far
+long Sim_Visited;                   // Candidate neighbours visited in the last tick
+double Sim_Tick_Time;               // Seconds spent computing the last tick
+
+// ******************** FUNCTIONS ************************
+
+// Fills in the default values of the update parameters
+void defaultParams(BoidParams *params)
+{
+    params->r_rule1=15;
+    params->r_rule2=1;
+    params->r_rule3=25;
+    params->r_ruleLeader=1;
+    params->k_rule1=0.15;
+    params->k_rule2=.5;
+    params->k_rule3=.15;
+    params->k_rule0=.25;
+    params->k_ruleLeader=0.0;
+    params->k_ruleHover=0.0;
+#ifdef _OPENMP
+    params->nThreads=omp_get_num_procs();
+#else
+    params->nThreads=1;
+#endif
+    params->tickRate=60;
+    params->substeps=4;
+    params->paused=false;
+    params->kernel=bestKernel();
+    params->skin=defaultSkin(params->kernel);
+    params->reorderInterval=32;
+    params->pairs=false;
+}
+
+// Returns the default neighbour list skin for the given kernel. Neighbour
+// lists halve the neighbours visited, but have to be gathered by index
+// and rebuilt every few ticks, which only pays off when the neighbours
+// are visited one at a time anyway: with the scalar kernel.
+float defaultSkin(int kernel)
+{
+    return kernel == KERNEL_SCALAR ? 4 : 0;
+}
+
+// Initialize Boid positions and velocity
+// Mind the SPEED_SCALE. You may need to change it to
+// achieve smooth animation - increase it if the
+// animation is too slow. Decrease it if it's too
+// fast and choppy.
+void randomizeBoids(long seed)
+{
+    srand48(seed);
+    for (int i=0; i<nBoids; i++)
+    {
+     // Initialize Boid locations and velocities randomly
+     Boid_Location.x[i]=(-.5+drand48())*SPACE_SCALE;
+     Boid_Location.y[i]=(-.5+drand48())*SPACE_SCALE;
+     Boid_Location.z[i]=(-.5+drand48())*SPACE_SCALE;
+     Boid_Velocity.x[i]=(-.5+drand48())*SPEED_SCALE;
+     Boid_Velocity.y[i]=(-.5+drand48())*SPEED_SCALE;
+     Boid_Velocity.z[i]=(-.5+drand48())*SPEED_SCALE;
+    }
+}
+
+// Picks between 1 and 5 boids at random to be leaders, by ID
+void chooseLeaders()
+{
+    nLeaders = rand()%5 + 1;
+    if (nLeaders > nBoids) nLeaders = nBoids;
+    for (int i = 0; i < nLeaders; ++i) {
+        leaders[i] = rand()%nBoids;
+    }
+}
+
+// Computes the velocity of boid i for the next tick into Next_Velocity,
+// before the speed limit; dampVelocities() then limits it and moves the
+// boid. Returns the number of candidate neighbours visited.
+int updateBoid(int i)
+{
+    /*
+     This function updates the position and velocity of Boid i, read the handout
+     and read the reference material in order to understand how the position and
+     velocity are updated.
+     */
+    // Velocity changes obtained from r and k rules
+    float v1[3], v2[3], v3[3], vLead[3], vHover[3];
+    float velocity[3];		// New velocity for boid i
+    int nVisited;			// Candidate neighbours looked at
+    
+    ///////////////////////////////////////////
+    // TO DO: Complete this function to update
+    // the Boid's velocity and location
+    //
+    // Reference: http://www.vergenet.net/~conrad/boids/pseudocode.html
+    //
+    // You need to implement Rules 1, 2, 3, and
+    //  paco's Rule 0. You must also do the
+    //  position update.
+    //
+    // Add at the top of this function any variables
+    // needed.
+    ///////////////////////////////////////////
+    
+    ///////////////////////////////////////////
+    // LEARNING OBJECTIVES: This part of the assignment
+    // is meant to help you learn about
+    //
+    // - Representing quantities using vectors
+    //   and points (velocity, direction of motion,
+    //   position, etc.)
+    // - Vector manipulation. Finding vectors with
+    //   a specific direction, adding and subtracting
+    //   vector quantities.
+    // - Thinking in terms of points, lines, and
+    //   their relationship to vectors:
+    //   Remember, a parametric line is given
+    //   by l(k)= p + (k*v)
+    //   where p is a point, v is  vector in the
+    //   direction of the line, and k a parameter.
+    // - Implementing simple rules that produce
+    //   complex visual behaviour.
+    //
+    // Be sure you fully understand these ideas!
+    // if you run into trouble, come to office
+    // hours.
+    ///////////////////////////////////////////
+    
+    
+    ///////////////////////////////////////////
+    //
+    // TO DO:
+    //
+    // Boid update Rule 1:
+    //  Move boids toward the common center of
+    // mass.
+    //
+    //  In the reference, the center of
+    // mass is computed for ALL boids. Here we
+    // will do it a little differently:
+    //
+    //  Compute the center of mass for all boids
+    // that are within a radius r_rule1 of the
+    // current boid. r_rule1 is a variable that
+    // can be manipulated via the user interface.
+    //
+    //  Once you have obtained a vector from
+    // the current boid to the center of mass
+    // you must update the velocity vector
+    // for this Boid so that it will move
+    // toward the center of mass.
+    //
+    //  The amount it will move toward the
+    // center of mass is given by another user
+    // interface variable called k_rule1.
+    //
+    // In effect:
+    //  Boid_Velocity += (k_rule1) * V1
+    //
+    // where V1 is the vector from the current
+    // boid position to the center of mass.
+    //
+    // Valid ranges are:
+    //  10 <= r_rule1 <= 100
+    //  0 <= k_rule1 <= 1
+    ///////////////////////////////////////////
+    
+    // Rules 1, 2, 3 and follow-the-leader all look at the same
+    // neighbourhood, so they are computed together in a single pass
+    // over the nearby boids (see applyRules()).
+    nVisited = applyRules(i, v1, v2, v3, vLead);
+    
+    ///////////////////////////////////////////
+    // QUESTION:
+    //  Is this the optimal way to implement this
+    // rule? can you see any problems or ways
+    // to improve this bit?
+    ///////////////////////////////////////////
+    
+    
+    
+    ///////////////////////////////////////////
+    //
+    // TO DO:
+    //
+    // Boid update Rule 2:
+    //  Boids steer to avoid collision.
+    //
+    // For each boid j within a small distance
+    // r_rule2 (changeable through the user
+    // interface), compute a vector
+    // from boid(i) to boid(j) (MIND THE DIRECTION!)
+    // then subtract a small amount k_rule2
+    // times this vector from boid(i)'s
+    // velocity. i.e.
+    //
+    // Boid_Velocity[i] -= k_rule2 * V2
+    //
+    // where V2 is the vector from boid(i)
+    // to void(j).
+    //
+    // k_rule2 can be manipulated through the
+    // user interface.
+    //
+    // Valid ranges are
+    //  1 <= r_rule2 <= 15
+    //  0 <= k_rule2 <= 1
+    ///////////////////////////////////////////
+    
+
+    ///////////////////////////////////////////
+    //
+    // TO DO:
+    //
+    // Boid update Rule 3:
+    //  Boids try to match speed with neighbours
+    //
+    //  Average the velocity of any boids within
+    // a given distance r_rule3 from boid(i).
+    // r_rule3 can be manipulated via the user
+    // interface.
+    //
+    //  Once the average velocity has been
+    // computed, add a small factor times this
+    // velocity to the boid's velocity, i.e.
+    //
+    // Boid_Velocity[i] += k_rule3 * V3
+    //
+    // where V3 is the average velocity for
+    // nearby boids and k_rule3 is a parameter
+    // that can be set via the user interface.
+    //
+    // Valid ranges:
+    //
+    // 10 <= r_rule3 <= 100
+    // 0 <= k_rule3 <= 1
+    ///////////////////////////////////////////
+    
+    // Crunchy effects
+    followModelVertex(i, vHover);
+    
+    ///////////////////////////////////////////
+    // DONE - CRUNCHY: Add a 'shapeness' component.
+    //  this should give your Boids a tendency
+    //  to hover near one of the points of a
+    //  3D model imported from file. Evidently
+    //  each Boid should hover to a different
+    //  point, and you must figure out how to
+    //  make the void fly toward that spot
+    //  and hover more-or-less around it
+    //  (depending on all Boid parameters
+    //   for the above rules).
+    //
+    //  3D model data is imported for you when
+    //  the user specifies the name of a model
+    //  file in .3ds format from the command
+    //  line.
+    //
+    //  The model data
+    //  is stored in the modelVertices array
+    //  and the number of vertices is in
+    //  n_vertices (if zero, there is no model
+    //  and the shapeness component should
+    //  have no effect whatsoever)
+    //
+    //  The coordinates (x,y,z) of the ith
+    //  mode, vertex can be accessed with
+    //  x=*(modelVertices+(3*i)+0);
+    //  y=*(modelVertices+(3*i)+1);
+    //  z=*(modelVertices+(3*i)+2);
+    //
+    //  Evidently, if you try to access more
+    //  points than there are in the array
+    //  you will get segfault (don't say I
+    //  didn't warn you!). Be careful with
+    //  indexing.
+    //
+    //  shapeness should be in [0,1], and
+    //  there is already a global variable
+    //  to store it. You must add a slider
+    //  to the GUI to control the amount of
+    //  shapeness (i.e. how strong the shape
+    //  constraints affect Boid position).
+    //
+    //  .3ds models can be found online, you
+    //  *must ensure* you are using a freely
+    //  distributable model!
+    //
+    //////////////////////////////////////////
+    
+    ///////////////////////////////////////////
+    //
+    // TO DO:
+    //
+    // Paco's Rule Zero,
+    //
+    //   Boids have inertia - they like to keep
+    // going in the same direction as before.
+    //
+    //   Add a component to the boid velocity
+    // that depends on the previous velocity
+    // (i.e. before the above updates). The weight
+    // of this term is given by k_rule0, which
+    // can be set in the user interface.
+    //
+    // Vaid ranges:
+    //   0 < k_rule0 < 1
+    ///////////////////////////////////////////
+    
+    // Update the velocity with the inertia and the rest of the rules.
+    // The current frame's state is only read here, the results go to
+    // Next_Velocity and Next_Location (see swapBoidState()).
+    velocity[0] = Boid_Velocity.x[i] + (v1[0]+v2[0]+v3[0]+vLead[0]+vHover[0])
+    + Sim_Params.k_rule0*Boid_Velocity.x[i];
+    velocity[1] = Boid_Velocity.y[i] + (v1[1]+v2[1]+v3[1]+vLead[1]+vHover[1])
+    + Sim_Params.k_rule0*Boid_Velocity.y[i];
+    velocity[2] = Boid_Velocity.z[i] + (v1[2]+v2[2]+v3[2]+vLead[2]+vHover[2])
+    + Sim_Params.k_rule0*Boid_Velocity.z[i];
+    
+    ///////////////////////////////////////////
+    // Enforcing bounds on motion
+    //
+    //  This is already implemented: The goal
+    // is to ensure boids won't stray too far
+    // from the viewing area.
+    //
+    //  This is done exactly as described in the
+    // reference.
+    //
+    //  Bounds on the viewing region are
+    //
+    //  -50 to 50 on each of the X, Y, and Z
+    //  directions.
+    ///////////////////////////////////////////
+    if (Boid_Location.x[i]<-50) velocity[0]+=1;
+    if (Boid_Location.x[i]>50) velocity[0]-=1;
+    if (Boid_Location.y[i]<-50) velocity[1]+=1;
+    if (Boid_Location.y[i]>50) velocity[1]-=1;
+    if (Boid_Location.z[i]<-50) velocity[2]+=1;
+    if (Boid_Location.z[i]>50) velocity[2]-=1;
+    
+    ///////////////////////////////////////////
+    // Velocity Limit:
+    //  This is already implemented. The goal
+    // is simply to avoid boids shooting off
+    // at unrealistic speeds.
+    //
+    //  You can tweak this part if you like,
+    // or you can simply leave it be.
+    //
+    //  The speed clamping used here was determined
+    // 'experimentally', i.e. I tweaked it by hand!
+    ///////////////////////////////////////////
+    //
+    //  Done for all boids at once by dampVelocities().
+    
+    ///////////////////////////////////////////
+    // QUESTION: Why add inertia at the end and
+    //  not at the beginning?
+    ///////////////////////////////////////////
+    
+    ///////////////////////////////////////////
+    //
+    // TO DO:
+    //
+    // Finally (phew!) update the position
+    // of this boid.
+    ///////////////////////////////////////////
+    
+    //  Also in dampVelocities().
+    Next_Velocity.x[i] = velocity[0];
+    Next_Velocity.y[i] = velocity[1];
+    Next_Velocity.z[i] = velocity[2];
+    
+    ///////////////////////////////////////////
+    // CRUNCHY:
+    //
+    //  Things you can add here to make the behaviour
+    // more interesting. Be sure to note in your
+    // report any extra work you have done.
+    //
+    // - Add a few obstacles (boxes or something like it)
+    //   and add code to have boids avoid these
+    //   obstacles
+    //
+    // - DONE - Follow the leader: Select a handful
+    //   (1 to 5) boids randomly. Add code so that
+    //   nearby boids tend to move toward these
+    //   'leaders'
+    //
+    // - Make the updates smoother: Idea, instead
+    //   of having hard thresholds on distances for
+    //   the update computations (r_rule1, r_rule2,
+    //   r_rule3), use a weighted computation
+    //   where contributions are weighted by
+    //   distance and the weight decays as a
+    //   function of the corresponding r_rule
+    //   parameter.
+    //
+    // - Add a few 'predatory boids'. Select
+    //   a couple of boids randomly. These become
+    //   predators and the rest of the boids
+    //   should have a strong tendency to
+    //   avoid them. The predatory boids should
+    //   follow the standard rules. However,
+    //   Be sure to plot the predatory boids
+    //   differently so we can easily see
+    //   who they are.
+    //
+    // - Make it go FAST. Consider and implement
+    //   ways to speed-up the boid update. Hint:
+    //   good approximations are often enough
+    //   to give the right visual impression.
+    //   What and how to approximate? that is the
+    //   problem.
+    //
+    //   Thoroughly describe any crunchy stuff in
+    //   the REPORT.
+    //
+    ///////////////////////////////////////////
+    
+    return nVisited;
+}
+
+// Applies the speed limit to the velocities computed by updateBoid():
+// each component v becomes sign(v)*sqrt(|v|). Then moves every boid
+// along its new velocity into Next_Location. copysignf() takes the sign
+// without a branch, so the loop compiles to vector square roots, a
+// SIMD register of boids at a time.
+void dampVelocities()
+{
+    float *vx = Next_Velocity.x, *vy = Next_Velocity.y, *vz = Next_Velocity.z;
+    float *px = Next_Location.x, *py = Next_Location.y, *pz = Next_Location.z;
+    const float *x = Boid_Location.x, *y = Boid_Location.y, *z = Boid_Location.z;
+#pragma omp parallel for simd schedule(static) num_threads(Sim_Params.nThreads)
+    for (int i = 0; i < nBoids; i++) {
+        vx[i] = copysignf(sqrtf(fabsf(vx[i])), vx[i]);
+        vy[i] = copysignf(sqrtf(fabsf(vy[i])), vy[i]);
+        vz[i] = copysignf(sqrtf(fabsf(vz[i])), vz[i]);
+        px[i] = x[i] + vx[i]/SPEED_SCALE;
+        py[i] = y[i] + vy[i]/SPEED_SCALE;
+        pz[i] = z[i] + vz[i]/SPEED_SCALE;
+    }
+}
+
+// Makes the state computed by updateBoid() the current frame. The old
+// current frame's buffers are reused for the next update.
+void swapBoidState()
+{
+    Vec3Array tmp;
+    tmp = Boid_Location;
+    Boid_Location = Next_Location;
+    Next_Location = tmp;
+    tmp = Boid_Velocity;
+    Boid_Velocity = Next_Velocity;
+    Next_Velocity = tmp;
+}
+
+// Advances the flock by one tick: bins the boids into the neighbour
+// grid, updates every boid, and makes the result the current state.
+void stepSimulation()
+{
+    // Every so often, sort the boids in memory by position
+    if (Sim_Params.reorderInterval > 0 && Sim_Tick % Sim_Params.reorderInterval == 0) {
+        reorderBoids();
+    }
+
+    // Cells are as large as the widest rule radius so a query only
+    // ever touches adjacent cells. With neighbour lists the grid is
+    // only needed, and rebuilt, when the lists are.
+    float range = fmax(fmax(Sim_Params.r_rule1, Sim_Params.r_rule2),
+                       fmax(Sim_Params.r_rule3, Sim_Params.r_ruleLeader));
+    long visited = 0;
+    if (Sim_Params.pairs) {
+        buildGrid(&Boid_Grid, &Boid_Location, &Boid_Velocity, range);
+        visited = accumulatePairs(&Boid_Grid);
+    } else if (Sim_Params.skin > 0) {
+        updateNeighbourLists(&Boid_Lists, range, Sim_Params.skin);
+    } else {
+        buildGrid(&Boid_Grid, &Boid_Location, &Boid_Velocity, range);
+    }
+
+    // Every boid reads the current frame and writes the next one, so
+    // the result does not depend on the order of the updates, and the
+    // loop is split across threads. The scheduling is dynamic because
+    // boids in dense parts of the flock have many more neighbours to
+    // visit than those on the fringes.
+#pragma omp parallel for schedule(dynamic, 64) num_threads(Sim_Params.nThreads) reduction(+:visited)
+    for (int i=0; i<nBoids; i++)
+    {
+        visited += updateBoid(i);	// Update velocity for boid i
+    }
+    dampVelocities();		// Limit the speeds and move the boids
+    swapBoidState();		// The next frame becomes the current one
+    Sim_Visited = visited;
+    Sim_Tick++;
+}
+
+// Runs one tick with the latest parameters from the UI, and hands the
+// result to the renderer as due at time (see getTime()). Returns
+// false, having done nothing, if the UI has paused the flock.
+bool advanceSimulation(double time)
+{
+    fetchParams();
+    if (Sim_Params.paused) return false;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    stepSimulation();
+    Sim_Tick_Time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    publishFrame(time);
+    return true;
+}
+
+// Body of the simulation thread. Runs one tick every 1/tickRate
+// seconds of real time, however fast the renderer draws, and publishes
+// each result to the renderer. The time is kept as a fixed schedule of
+// ticks: when a tick takes longer than its slot, the ones that fell
+// due meanwhile are run back to back to catch up, up to substeps of
+// them. If the simulation is further behind than that, it gives up on
+// the lost time and carries on from the current time, rather than
+// running ever longer bursts. While paused it only picks up new
+// parameters, once per tick.
+void simulationThread()
+{
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    while (Sim_Running.load())
+    {
+        for (int tick=0; tick<Sim_Params.substeps && next <= std::chrono::steady_clock::now(); tick++)
+        {
+            advanceSimulation(std::chrono::duration<double>(next.time_since_epoch()).count());
+            next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(1.0 / Sim_Params.tickRate));
+        }
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (next < now) next = now;
+        std::this_thread::sleep_until(next);
+    }
+}
+
+void startSimulation()
+{
+    Sim_Running = true;
+    Sim_Thread = std::thread(simulationThread);
+}
+
+void stopSimulation()
+{
+    if (!Sim_Thread.joinable()) return;
+    Sim_Running = false;
+    Sim_Thread.join();
+}
+
+// Hands a new set of update parameters to the simulation thread, which
+// picks them up at the start of its next tick (render thread)
+void setParams(const BoidParams *params)
+{
+    std::lock_guard<std::mutex> lock(Params_Lock);
+    Pending_Params = *params;
+}
+
+// Takes the latest update parameters from the UI (simulation thread)
+void fetchParams()
+{
+    std::lock_guard<std::mutex> lock(Params_Lock);
+    Sim_Params = Pending_Params;
+}
+
+// Allocates the three frames shared by the simulation and the renderer,
+// and gives the renderer the initial state of the flock to draw.
+void initFrames()
+{
+    for (int f = 0; f < 3; f++) {
+        allocFrame(&Frames[f]);
+        Frames[f].tick = 0;
+        Frames[f].time = 0;
+        Frames[f].tickLength = 1;
+        Frames[f].tickTime = 0;
+    }
+    Frame_Reading = 0;
+    Frame_Shared = 1;
+    Frame_Writing = 2;
+    BoidFrame *frame = &Frames[Frame_Reading];
+    copyInIdOrder(&frame->location, &Boid_Location);
+    copyInIdOrder(&frame->velocity, &Boid_Velocity);
+    copyInIdOrder(&frame->previousLocation, &Boid_Location);
+    copyInIdOrder(&frame->previousVelocity, &Boid_Velocity);
+}
+
+// Copies the current state into the simulation's frame and swaps it
+// with the shared one, flagged as new (simulation thread). If the
+// renderer hasn't picked up the previous frame it is simply replaced.
+// time is when the state is due to be shown, see interpolateFrame().
+// Frames hold the boids in ID order, whatever order the simulation
+// keeps them in.
+void publishFrame(double time)
+{
+    BoidFrame *frame = &Frames[Frame_Writing];
+    copyInIdOrder(&frame->location, &Boid_Location);
+    copyInIdOrder(&frame->velocity, &Boid_Velocity);
+    // swapBoidState() left the state from before the tick in Next_*
+    copyInIdOrder(&frame->previousLocation, &Next_Location);
+    copyInIdOrder(&frame->previousVelocity, &Next_Velocity);
+    frame->tick = Sim_Tick;
+    frame->time = time;
+    frame->tickLength = 1.0 / Sim_Params.tickRate;
+    frame->tickTime = Sim_Tick_Time;
+    Frame_Writing = Frame_Shared.exchange(Frame_Writing | FRAME_NEW) & FRAME_INDEX;
+}
+
+void allocFrame(BoidFrame *frame)
+{
+    allocVec3Array(&frame->location, nBoids);
+    allocVec3Array(&frame->velocity, nBoids);
+    allocVec3Array(&frame->previousLocation, nBoids);
+    allocVec3Array(&frame->previousVelocity, nBoids);
+}
+
+void freeFrame(BoidFrame *frame)
+{
+    freeVec3Array(&frame->location);
+    freeVec3Array(&frame->velocity);
+    freeVec3Array(&frame->previousLocation);
+    freeVec3Array(&frame->previousVelocity);
+}
+
+// Fills out with the flock part way through the tick that produced
+// frame: at its start for alpha 0, at its end for alpha 1. alpha is
+// clamped to that range, so the flock never moves past the newest
+// state. Only out's location and velocity are set.
+void interpolateFrame(BoidFrame *frame, float alpha, BoidFrame *out)
+{
+    alpha = fmin(fmax(alpha, 0), 1);
+    float *to[6] = {out->location.x, out->location.y, out->location.z,
+                    out->velocity.x, out->velocity.y, out->velocity.z};
+    float *from[6] = {frame->previousLocation.x, frame->previousLocation.y, frame->previousLocation.z,
+                      frame->previousVelocity.x, frame->previousVelocity.y, frame->previousVelocity.z};
+    float *until[6] = {frame->location.x, frame->location.y, frame->location.z,
+                       frame->velocity.x, frame->velocity.y, frame->velocity.z};
+    for (int a = 0; a < 6; a++) {
+        float *o = to[a], *p = from[a], *q = until[a];
+#pragma omp simd
+        for (int i = 0; i < nBoids; i++) o[i] = p[i] + alpha*(q[i] - p[i]);
+    }
+    out->tick = frame->tick;
+    out->time = frame->time;
+    out->tickLength = frame->tickLength;
+    out->tickTime = frame->tickTime;
+}
+
+// Swaps the renderer's frame for the shared one if the simulation has
+// published a new frame since the last call (render thread). Returns
+// whether Frame_Reading changed.
+bool acquireFrame()
+{
+    if (!(Frame_Shared.load() & FRAME_NEW)) return false;
+    Frame_Reading = Frame_Shared.exchange(Frame_Reading) & FRAME_INDEX;
+    return true;
+}
+
+// Whether the simulation has published a frame the renderer has not
+// picked up yet, without picking it up (render thread)
+bool frameReady()
+{
+    return Frame_Shared.load() & FRAME_NEW;
+}
+
+// Computes the velocity changes for rules 1, 2, 3 and follow-the-leader
+// in one pass over the boids near boidIdx, from its neighbour list or
+// from the grid, unless accumulatePairs() has already done it for all
+// boids (in which case no neighbours are visited here and 0 is
+// returned). Every candidate neighbour is visited once and tested
+// against each rule radius by squared distance, by the SIMD kernel
+// chosen in Sim_Params (see BoidsKernels.cpp):
+//  v1    - pull toward the centre of mass of boids within r_rule1
+//  v2    - push away from boids within r_rule2
+//  v3    - average velocity of other boids within r_rule3
+//  vLead - pull toward leaders within r_ruleLeader
+// Returns the number of candidate neighbours visited.
+int applyRules(int boidIdx, float *v1, float *v2, float *v3, float *vLead) {
+    const BoidParams *p = &Sim_Params;
+    NeighbourQuery query;
+    NeighbourSums sums;
+    float *self_position = query.position;
+    self_position[0] = Boid_Location.x[boidIdx];
+    self_position[1] = Boid_Location.y[boidIdx];
+    self_position[2] = Boid_Location.z[boidIdx];
+    query.boid = boidIdx;
+    query.radiusSq[0] = p->r_rule1*p->r_rule1;
+    query.radiusSq[1] = p->r_rule2*p->r_rule2;
+    query.radiusSq[2] = p->r_rule3*p->r_rule3;
+    query.radiusSq[3] = p->r_ruleLeader*p->r_ruleLeader;
+    int nVisited;
+    
+    if (p->pairs) {
+        PairSums *all = &Boid_Pair_Sums;
+        sums.centre[0] = all->centre.x[boidIdx];
+        sums.centre[1] = all->centre.y[boidIdx];
+        sums.centre[2] = all->centre.z[boidIdx];
+        sums.separation[0] = all->separation.x[boidIdx];
+        sums.separation[1] = all->separation.y[boidIdx];
+        sums.separation[2] = all->separation.z[boidIdx];
+        sums.velocity[0] = all->velocity.x[boidIdx];
+        sums.velocity[1] = all->velocity.y[boidIdx];
+        sums.velocity[2] = all->velocity.z[boidIdx];
+        sums.leaderPull[0] = all->leaderPull.x[boidIdx];
+        sums.leaderPull[1] = all->leaderPull.y[boidIdx];
+        sums.leaderPull[2] = all->leaderPull.z[boidIdx];
+        sums.n1 = all->n1[boidIdx];
+        sums.n3 = all->n3[boidIdx];
+        nVisited = 0;
+    } else if (p->skin > 0) {
+        // The list holds every boid within range, and then some
+        nVisited = listKernel(p->kernel)(&Boid_Lists, &Boid_Location, &Boid_Velocity, &query, &sums);
+    } else {
+        // Only the grid cells overlapping the widest radius can hold
+        // neighbours. Neighbours are read from the grid's copies, i.e. as
+        // they were when the grid was built at the start of the frame.
+        float range = fmax(fmax(p->r_rule1, p->r_rule2), fmax(p->r_rule3, p->r_ruleLeader));
+        SpatialGrid *grid = &Boid_Grid;
+        for (int d = 0; d < 3; d++) {
+            query.lo[d] = gridCell(grid, self_position[d] - range, d);
+            query.hi[d] = gridCell(grid, self_position[d] + range, d);
+        }
+        nVisited = neighbourKernel(p->kernel)(grid, &query, &sums);
+    }
+    float *centre = sums.centre, *separation = sums.separation;
+    float *velocity = sums.velocity, *leaderPull = sums.leaderPull;
+    float n1 = sums.n1, n3 = sums.n3;
+    
+    // Rule 1: the boid itself is always in range, so n1 >= 1
+    centre[0] /= n1;
+    centre[1] /= n1;
+    centre[2] /= n1;
+    v1[0] = (centre[0] - self_position[0]) * p->k_rule1;
+    v1[1] = (centre[1] - self_position[1]) * p->k_rule1;
+    v1[2] = (centre[2] - self_position[2]) * p->k_rule1;
+    
+    // Rule 2
+    v2[0] = -separation[0] * p->k_rule2;
+    v2[1] = -separation[1] * p->k_rule2;
+    v2[2] = -separation[2] * p->k_rule2;
+    
+    // Rule 3
+    v3[0] = v3[1] = v3[2] = 0;
+    if (n3 > 0) {
+        v3[0] = p->k_rule3 * velocity[0] / n3;
+        v3[1] = p->k_rule3 * velocity[1] / n3;
+        v3[2] = p->k_rule3 * velocity[2] / n3;
+    }
+    
+    // Follow the leader
+    vLead[0] = leaderPull[0] * p->k_ruleLeader;
+    vLead[1] = leaderPull[1] * p->k_ruleLeader;
+    vLead[2] = leaderPull[2] * p->k_ruleLeader;
+    
+    return nVisited;
+}
+
+void followModelVertex(int boidIdx, float *v) {
+    v[0] = 0;
+    v[1] = 0;
+    v[2] = 0;
+    if (n_vertices > 0) {
+        int mIdx = Boid_Model_Vertex[boidIdx];
+        float *m_position = modelVertices + mIdx*3;
+        v[0] = (m_position[0] - Boid_Location.x[boidIdx]) * Sim_Params.k_ruleHover;
+        v[1] = (m_position[1] - Boid_Location.y[boidIdx]) * Sim_Params.k_ruleHover;
+        v[2] = (m_position[2] - Boid_Location.z[boidIdx]) * Sim_Params.k_ruleHover;
+    }
+}
+
+// Returns the grid cell along the given axis containing coord, clamped
+// to the extent of the grid.
+int gridCell(SpatialGrid *grid, float coord, int axis) {
+    int c = (int)floor((coord - grid->origin[axis]) / grid->cellSize);
+    if (c < 0) return 0;
+    if (c >= grid->dims[axis]) return grid->dims[axis] - 1;
+    return c;
+}
+
+// Bins all boids, at the given locations, into a uniform grid with cells
+// of (at least) the given size, covering the bounding box of the flock.
+// Boids are not confined to the viewing box, so the bounds are
+// recomputed on every rebuild, and the cell size grows if needed to keep
+// the grid within MAX_GRID_DIM. With velocity NULL only the locations
+// are copied into the grid, and the velocity and leader copies are left
+// out: that is all the renderer needs for culling, and it must not read
+// the leaders, which belong to the simulation thread.
+void buildGrid(SpatialGrid *grid, Vec3Array *location, Vec3Array *velocity, float cellSize) {
+    float lo[3], hi[3], span = 0;
+    
+    flockBounds(location, lo, hi);
+    for (int d = 0; d < 3; d++) {
+        if (hi[d] - lo[d] > span) span = hi[d] - lo[d];
+    }
+    if (span / cellSize > MAX_GRID_DIM - 1) {
+        cellSize = span / (MAX_GRID_DIM - 1);
+    }
+    
+    grid->cellSize = cellSize;
+    grid->nCells = 1;
+    for (int d = 0; d < 3; d++) {
+        grid->origin[d] = lo[d];
+        grid->dims[d] = (int)((hi[d] - lo[d]) / cellSize) + 1;
+        grid->nCells *= grid->dims[d];
+    }
+    if (grid->nCells + 1 > grid->cellCapacity) {
+        grid->cellCapacity = grid->nCells + 1;
+        grid->cellStart = (int *)realloc(grid->cellStart, grid->cellCapacity*sizeof(int));
+    }
+    if (nBoids > grid->boidCapacity || (velocity != NULL && grid->leader == NULL)) {
+        freeVec3Array(&grid->location);
+        freeVec3Array(&grid->velocity);
+        free(grid->leader);
+        grid->leader = NULL;
+        grid->boidCapacity = nBoids;
+        grid->boids = (int *)realloc(grid->boids, nBoids*sizeof(int));
+        grid->boidCell = (int *)realloc(grid->boidCell, nBoids*sizeof(int));
+        allocVec3Array(&grid->location, nBoids);
+        if (velocity != NULL) {
+            allocVec3Array(&grid->velocity, nBoids);
+            grid->leader = allocAligned(nBoids);
+        }
+    }
+    
+    // Counting sort of the boids by cell: count the boids in each
+    // cell, turn the counts into start offsets, then scatter.
+    int *cellStart = grid->cellStart;
+    memset(cellStart, 0, (grid->nCells + 1)*sizeof(int));
+    for (int i = 0; i < nBoids; i++) {
+        int cx = gridCell(grid, location->x[i], 0);
+        int cy = gridCell(grid, location->y[i], 1);
+        int cz = gridCell(grid, location->z[i], 2);
+        grid->boidCell[i] = (cz*grid->dims[1] + cy)*grid->dims[0] + cx;
+        cellStart[grid->boidCell[i] + 1]++;
+    }
+    for (int c = 0; c < grid->nCells; c++) {
+        cellStart[c + 1] += cellStart[c];
+    }
+    for (int i = 0; i < nBoids; i++) {
+        int k = cellStart[grid->boidCell[i]]++;
+        grid->boids[k] = i;
+        grid->location.x[k] = location->x[i];
+        grid->location.y[k] = location->y[i];
+        grid->location.z[k] = location->z[i];
+    }
+    if (velocity != NULL) {
+        for (int k = 0; k < nBoids; k++) {
+            int i = grid->boids[k];
+            grid->velocity.x[k] = velocity->x[i];
+            grid->velocity.y[k] = velocity->y[i];
+            grid->velocity.z[k] = velocity->z[i];
+            grid->leader[k] = isLeader(i) ? 1.0f : 0.0f;
+        }
+    }
+    // The scatter advanced every start to the next cell's start; shift back
+    for (int c = grid->nCells; c > 0; c--) {
+        cellStart[c] = cellStart[c - 1];
+    }
+    cellStart[0] = 0;
+}
+
+// Computes the neighbour sums of every boid into Boid_Pair_Sums,
+// visiting each pair of boids within range of each other only once.
+// Cells are at least as large as the widest rule radius, so a boid's
+// neighbours are all in its own cell or the 26 around it. Each pair of
+// neighbouring cells is visited from one side only: a boid is paired
+// with the boids after it in its own cell and with those in 13 of the
+// surrounding cells, the next one along x and the three-cell rows at
+// (y+1, z), (y-1, z+1), (y, z+1) and (y+1, z+1). Rows of cells along x
+// are contiguous in the grid, so that is 5 runs of slots per boid.
+//
+// Both boids of a pair get their share of it, so threads would write to
+// the same sums; each thread adds into sums of its own instead, and
+// these are added up at the end. Returns the number of pairs visited.
+long accumulatePairs(SpatialGrid *grid) {
+    const BoidParams *p = &Sim_Params;
+    int nThreads = p->nThreads;
+    if (nThreads > Pair_Threads || nBoids > Pair_Capacity) {
+        for (int t = 0; t < Pair_Threads; t++) freePairSums(&Pair_Thread_Sums[t]);
+        freePairSums(&Boid_Pair_Sums);
+        Pair_Threads = nThreads;
+        Pair_Capacity = nBoids;
+        Pair_Thread_Sums = (PairSums *)realloc(Pair_Thread_Sums, nThreads*sizeof(PairSums));
+        for (int t = 0; t < nThreads; t++) allocPairSums(&Pair_Thread_Sums[t], nBoids);
+        allocPairSums(&Boid_Pair_Sums, nBoids);
+    }
+    PairKernel kernel = pairKernel(p->kernel);
+    NeighbourQuery query;
+    query.radiusSq[0] = p->r_rule1*p->r_rule1;
+    query.radiusSq[1] = p->r_rule2*p->r_rule2;
+    query.radiusSq[2] = p->r_rule3*p->r_rule3;
+    query.radiusSq[3] = p->r_ruleLeader*p->r_ruleLeader;
+    const int rows[4][2] = {{1, 0}, {-1, 1}, {0, 1}, {1, 1}};     // (y, z) offsets
+    int *dims = grid->dims;
+    long visited = 0;
+    
+#pragma omp parallel num_threads(nThreads) firstprivate(query) reduction(+:visited)
+    {
+#ifdef _OPENMP
+        PairSums *sums = &Pair_Thread_Sums[omp_get_thread_num()];
+#else
+        PairSums *sums = &Pair_Thread_Sums[0];
+#endif
+        // All of them, in case there are fewer threads than asked for
+#pragma omp for schedule(static)
+        for (int t = 0; t < nThreads; t++) clearPairSums(&Pair_Thread_Sums[t]);
+#pragma omp for schedule(dynamic, 64)
+        for (int k = 0; k < nBoids; k++) {
+            int cell = grid->boidCell[grid->boids[k]];
+            int cx = cell % dims[0];
+            int cy = cell / dims[0] % dims[1];
+            int cz = cell / (dims[0]*dims[1]);
+            query.boid = k;
+            
+            // The rest of its own cell, and the next cell along x
+            int last = grid->cellStart[cx + 1 < dims[0] ? cell + 2 : cell + 1];
+            visited += kernel(grid, &query, k + 1, last, sums);
+            
+            for (int r = 0; r < 4; r++) {
+                int ny = cy + rows[r][0], nz = cz + rows[r][1];
+                if (ny < 0 || ny >= dims[1] || nz >= dims[2]) continue;
+                int rowCell = (nz*dims[1] + ny)*dims[0];
+                int first = grid->cellStart[rowCell + (cx > 0 ? cx - 1 : 0)];
+                last = grid->cellStart[rowCell + (cx + 1 < dims[0] ? cx + 2 : cx + 1)];
+                visited += kernel(grid, &query, first, last, sums);
+            }
+        }
+        
+        // Add up the threads' sums, and the boids' own part in the
+        // centre of mass, into boid order
+#pragma omp for schedule(static)
+        for (int k = 0; k < nBoids; k++) {
+            float total[14];
+            for (int s = 0; s < 14; s++) total[s] = 0;
+            for (int t = 0; t < nThreads; t++) {
+                PairSums *from = &Pair_Thread_Sums[t];
+                total[0] += from->centre.x[k]; total[1] += from->centre.y[k]; total[2] += from->centre.z[k];
+                total[3] += from->separation.x[k]; total[4] += from->separation.y[k]; total[5] += from->separation.z[k];
+                total[6] += from->velocity.x[k]; total[7] += from->velocity.y[k]; total[8] += from->velocity.z[k];
+                total[9] += from->leaderPull.x[k]; total[10] += from->leaderPull.y[k]; total[11] += from->leaderPull.z[k];
+                total[12] += from->n1[k]; total[13] += from->n3[k];
+            }
+            PairSums *to = &Boid_Pair_Sums;
+            int i = grid->boids[k];
+            to->centre.x[i] = total[0] + grid->location.x[k];
+            to->centre.y[i] = total[1] + grid->location.y[k];
+            to->centre.z[i] = total[2] + grid->location.z[k];
+            to->separation.x[i] = total[3]; to->separation.y[i] = total[4]; to->separation.z[i] = total[5];
+            to->velocity.x[i] = total[6]; to->velocity.y[i] = total[7]; to->velocity.z[i] = total[8];
+            to->leaderPull.x[i] = total[9]; to->leaderPull.y[i] = total[10]; to->leaderPull.z[i] = total[11];
+            to->n1[i] = total[12] + 1;
+            to->n3[i] = total[13];
+        }
+    }
+    return visited;
+}
+
+void allocPairSums(PairSums *sums, int n) {
+    allocVec3Array(&sums->centre, n);
+    allocVec3Array(&sums->separation, n);
+    allocVec3Array(&sums->velocity, n);
+    allocVec3Array(&sums->leaderPull, n);
+    sums->n1 = allocAligned(n);
+    sums->n3 = allocAligned(n);
+}
+
+void freePairSums(PairSums *sums) {
+    freeVec3Array(&sums->centre);
+    freeVec3Array(&sums->separation);
+    freeVec3Array(&sums->velocity);
+    freeVec3Array(&sums->leaderPull);
+    free(sums->n1);
+    free(sums->n3);
+    sums->n1 = sums->n3 = NULL;
+}
+
+// Zeroes all nBoids entries of every sum
+void clearPairSums(PairSums *sums) {
+    Vec3Array *vectors[4] = {&sums->centre, &sums->separation, &sums->velocity, &sums->leaderPull};
+    for (int v = 0; v < 4; v++) {
+        memset(vectors[v]->x, 0, nBoids*sizeof(float));
+        memset(vectors[v]->y, 0, nBoids*sizeof(float));
+        memset(vectors[v]->z, 0, nBoids*sizeof(float));
+    }
+    memset(sums->n1, 0, nBoids*sizeof(float));
+    memset(sums->n3, 0, nBoids*sizeof(float));
+}
+
+// Fills lo and hi with the corners of the bounding box of the boids
+void flockBounds(Vec3Array *location, float *lo, float *hi) {
+    lo[0] = hi[0] = nBoids > 0 ? location->x[0] : 0;
+    lo[1] = hi[1] = nBoids > 0 ? location->y[0] : 0;
+    lo[2] = hi[2] = nBoids > 0 ? location->z[0] : 0;
+    for (int i = 1; i < nBoids; i++) {
+        lo[0] = fmin(lo[0], location->x[i]);
+        hi[0] = fmax(hi[0], location->x[i]);
+        lo[1] = fmin(lo[1], location->y[i]);
+        hi[1] = fmax(hi[1], location->y[i]);
+        lo[2] = fmin(lo[2], location->z[i]);
+        hi[2] = fmax(hi[2], location->z[i]);
+    }
+}
+
+// Returns the Morton (Z-order) code of a cell given by three 10-bit
+// coordinates: their bits interleaved, so that cells with close codes
+// are close in space.
+unsigned int mortonCode(unsigned int x, unsigned int y, unsigned int z) {
+    unsigned int c[3] = {x, y, z};
+    for (int d = 0; d < 3; d++) {
+        // Spread the 10 bits out to every third bit
+        unsigned int v = c[d] & 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        c[d] = v;
+    }
+    return c[0] | (c[1] << 1) | (c[2] << 2);
+}
+
+// Sorts the boids in memory by the Morton code of their position, so
+// boids that are close in space are close in the arrays, and visiting
+// a boid's neighbours touches few cache lines. Boids drift apart as
+// they fly, so this is redone every reorderInterval ticks.
+//
+// The order in memory is private to the simulation: everything indexed
+// by boid (state, model vertex) moves with the boids, and Boid_Id keeps
+// track of which boid is where, so published frames are in ID order
+// (see publishFrame()) and the renderer never sees a change. The
+// leaders are kept by ID, so they never change after setup.
+void reorderBoids() {
+    float lo[3], hi[3];
+    flockBounds(&Boid_Location, lo, hi);
+    float span = fmax(fmax(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]);
+    float scale = span > 0 ? 1023 / span : 0;
+    
+    // Sort (code, index) pairs packed in one key, so equal codes keep
+    // their current order
+    uint64_t *keys = (uint64_t *)malloc(nBoids*sizeof(uint64_t));
+    int *newId = (int *)malloc(nBoids*sizeof(int));
+    int *newVertex = (int *)malloc(nBoids*sizeof(int));
+    if (keys == NULL || newId == NULL || newVertex == NULL) {
+        fprintf(stderr,"Unable to allocate memory for %d boids\n", nBoids);
+        exit(1);
+    }
+    for (int i = 0; i < nBoids; i++) {
+        unsigned int code = mortonCode((unsigned int)((Boid_Location.x[i] - lo[0])*scale),
+                                       (unsigned int)((Boid_Location.y[i] - lo[1])*scale),
+                                       (unsigned int)((Boid_Location.z[i] - lo[2])*scale));
+        keys[i] = (uint64_t)code << 32 | (unsigned int)i;
+    }
+    std::sort(keys, keys + nBoids);
+    
+    // Gather into the new order, using the Next_* arrays (free between
+    // ticks) for the state
+    for (int j = 0; j < nBoids; j++) {
+        int i = (int)(keys[j] & 0xffffffff);
+        Next_Location.x[j] = Boid_Location.x[i];
+        Next_Location.y[j] = Boid_Location.y[i];
+        Next_Location.z[j] = Boid_Location.z[i];
+        Next_Velocity.x[j] = Boid_Velocity.x[i];
+        Next_Velocity.y[j] = Boid_Velocity.y[i];
+        Next_Velocity.z[j] = Boid_Velocity.z[i];
+        newId[j] = Boid_Id[i];
+        newVertex[j] = Boid_Model_Vertex[i];
+    }
+    swapBoidState();
+    std::swap(Boid_Id, newId);
+    Boid_Permuted = true;
+    std::swap(Boid_Model_Vertex, newVertex);
+    // The neighbour lists refer to boids by index, so start them over
+    Boid_Lists.nBoids = 0;
+    
+    free(keys);
+    free(newId);
+    free(newVertex);
+}
+
+// Finds the boids within reach of boidIdx, itself included, among the
+// grid's copies, and returns how many there are. Their indices are
+// stored in list, unless it is NULL; list needs room for one more.
+int gridNeighbours(SpatialGrid *grid, int boidIdx, float reach, int *list) {
+    float self_position[3] = {Boid_Location.x[boidIdx], Boid_Location.y[boidIdx], Boid_Location.z[boidIdx]};
+    float reachSq = reach*reach;
+    int lo[3], hi[3];
+    int n = 0;
+    
+    for (int d = 0; d < 3; d++) {
+        lo[d] = gridCell(grid, self_position[d] - reach, d);
+        hi[d] = gridCell(grid, self_position[d] + reach, d);
+    }
+    for (int cz = lo[2]; cz <= hi[2]; cz++) {
+        for (int cy = lo[1]; cy <= hi[1]; cy++) {
+            int rowCell = (cz*grid->dims[1] + cy)*grid->dims[0];
+            int first = grid->cellStart[rowCell + lo[0]];
+            int last = grid->cellStart[rowCell + hi[0] + 1];
+            const float *px = grid->location.x, *py = grid->location.y, *pz = grid->location.z;
+            if (list == NULL) {
+                // Only counting, which vectorizes
+                int count = 0;
+#pragma omp simd reduction(+:count)
+                for (int k = first; k < last; k++) {
+                    count += distanceSq(self_position, px[k], py[k], pz[k]) <= reachSq;
+                }
+                n += count;
+                continue;
+            }
+            // Every candidate is written, and kept by moving past it if
+            // in reach; there are too many in reach for a branch to guess
+            for (int k = first; k < last; k++) {
+                list[n] = grid->boids[k];
+                n += distanceSq(self_position, px[k], py[k], pz[k]) <= reachSq;
+            }
+        }
+    }
+    return n;
+}
+
+// Rebuilds the neighbour lists if they may be missing a neighbour in
+// range: the radii, the skin or the number of boids have changed, or
+// some boid has moved more than half the skin since the last build (two
+// boids heading for each other may then have closed the whole skin).
+// Returns whether the lists were rebuilt.
+bool updateNeighbourLists(NeighbourLists *lists, float range, float skin) {
+    if (lists->nBoids == nBoids && lists->range == range && lists->skin == skin &&
+        maxDisplacementSq(&lists->builtAt) <= 0.25f*skin*skin) {
+        return false;
+    }
+    buildNeighbourLists(lists, range, skin);
+    return true;
+}
+
+// Builds the list of boids within range + skin of every boid, through
+// a grid with cells that large. Each list is first counted and then
+// filled in, so that both passes can be split across threads.
+void buildNeighbourLists(NeighbourLists *lists, float range, float skin) {
+    float reach = range + skin;
+    SpatialGrid *grid = &Boid_Grid;
+    buildGrid(grid, &Boid_Location, &Boid_Velocity, reach);
+    
+    if (nBoids > lists->boidCapacity) {
+        freeVec3Array(&lists->builtAt);
+        free(lists->leader);
+        lists->boidCapacity = nBoids;
+        lists->start = (int *)realloc(lists->start, (nBoids + 1)*sizeof(int));
+        lists->leader = allocAligned(nBoids);
+        allocVec3Array(&lists->builtAt, nBoids);
+    }
+    
+    int *start = lists->start;
+    start[0] = 0;
+#pragma omp parallel for schedule(dynamic, 64) num_threads(Sim_Params.nThreads)
+    for (int i = 0; i < nBoids; i++) {
+        start[i + 1] = gridNeighbours(grid, i, reach, NULL);
+    }
+    for (int i = 0; i < nBoids; i++) {
+        start[i + 1] += start[i];
+    }
+    if (start[nBoids] > lists->capacity) {
+        lists->capacity = start[nBoids] + start[nBoids]/4;     // Room for the flock to bunch up
+        free(lists->neighbours);
+        lists->neighbours = (int *)malloc(lists->capacity*sizeof(int));
+        if (lists->neighbours == NULL) {
+            fprintf(stderr,"Unable to allocate neighbour lists for %d boids\n", nBoids);
+            exit(1);
+        }
+    }
+    
+    // Filling a list writes one entry past its end, into the next
+    // boid's list, so they are filled in scratch space and copied
+    int nThreads = Sim_Params.nThreads;
+    if (nThreads > List_Scratch_Threads || nBoids + 1 > List_Scratch_Capacity) {
+        for (int t = 0; t < List_Scratch_Threads; t++) free(List_Scratch[t]);
+        List_Scratch_Threads = nThreads;
+        List_Scratch_Capacity = nBoids + 1;
+        List_Scratch = (int **)realloc(List_Scratch, nThreads*sizeof(int *));
+        if (List_Scratch == NULL) {
+            fprintf(stderr,"Unable to allocate neighbour lists for %d boids\n", nBoids);
+            exit(1);
+        }
+        for (int t = 0; t < nThreads; t++) {
+            List_Scratch[t] = (int *)malloc(List_Scratch_Capacity*sizeof(int));
+            if (List_Scratch[t] == NULL) {
+                fprintf(stderr,"Unable to allocate neighbour lists for %d boids\n", nBoids);
+                exit(1);
+            }
+        }
+    }
+#pragma omp parallel num_threads(nThreads)
+    {
+#ifdef _OPENMP
+        int *scratch = List_Scratch[omp_get_thread_num()];
+#else
+        int *scratch = List_Scratch[0];
+#endif
+#pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < nBoids; i++) {
+            int n = gridNeighbours(grid, i, reach, scratch);
+            memcpy(lists->neighbours + start[i], scratch, n*sizeof(int));
+        }
+    }
+    
+    for (int i = 0; i < nBoids; i++) {
+        lists->leader[i] = isLeader(i) ? 1.0f : 0.0f;
+    }
+    copyVec3Array(&lists->builtAt, &Boid_Location);
+    lists->range = range;
+    lists->skin = skin;
+    lists->nBoids = nBoids;
+    lists->builds++;
+}
+
+// Returns the largest squared distance any boid has moved from from
+float maxDisplacementSq(Vec3Array *from) {
+    float moved = 0;
+#pragma omp parallel for simd reduction(max:moved) num_threads(Sim_Params.nThreads)
+    for (int i = 0; i < nBoids; i++) {
+        moved = fmaxf(moved, lengthSq(Boid_Location.x[i] - from->x[i],
+                                      Boid_Location.y[i] - from->y[i],
+                                      Boid_Location.z[i] - from->z[i]));
+    }
+    return moved;
+}
+
+// If there is a .3ds model, assigns each boid to
+// hover around a randomly chosen vertex in the model.
+void assignToModelVertices() {
+    if (n_vertices > 0) {
+        for (int i = 0; i < nBoids; ++i) {
+            Boid_Model_Vertex[i] = rand() % n_vertices;
+        }
+    }
+}
+
+// Returns a zeroed, 64-byte aligned array of n floats, with n rounded
+// up to a whole number of SIMD registers.
+float *allocAligned(int n) {
+    void *mem;
+    size_t padded = ((size_t)n + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+    if (posix_memalign(&mem, 64, padded*sizeof(float)) != 0) {
+        fprintf(stderr,"Unable to allocate memory for %d boids\n", n);
+        exit(1);
+    }
+    memset(mem, 0, padded*sizeof(float));
+    return (float *)mem;
+}
+
+void allocVec3Array(Vec3Array *a, int n) {
+    a->x = allocAligned(n);
+    a->y = allocAligned(n);
+    a->z = allocAligned(n);
+}
+
+void freeVec3Array(Vec3Array *a) {
+    free(a->x);
+    free(a->y);
+    free(a->z);
+    a->x = a->y = a->z = NULL;
+}
+
+// Copies all nBoids entries of from into to
+void copyVec3Array(Vec3Array *to, Vec3Array *from) {
+    memcpy(to->x, from->x, nBoids*sizeof(float));
+    memcpy(to->y, from->y, nBoids*sizeof(float));
+    memcpy(to->z, from->z, nBoids*sizeof(float));
+}
+
+// Copies entry i of from into entry index[i] of to, for all nBoids entries
+void scatterVec3Array(Vec3Array *to, Vec3Array *from, int *index) {
+    for (int i = 0; i < nBoids; i++) {
+        to->x[index[i]] = from->x[i];
+        to->y[index[i]] = from->y[i];
+        to->z[index[i]] = from->z[i];
+    }
+}
+
+// Copies the per-boid from, in storage order, into to in ID order. Until
+// the first reorderBoids() the two orders are the same, and it is a
+// plain copy.
+void copyInIdOrder(Vec3Array *to, Vec3Array *from) {
+    if (Boid_Permuted) {
+        scatterVec3Array(to, from, Boid_Id);
+    } else {
+        copyVec3Array(to, from);
+    }
+}
+
+// Allocates the simulation state for nBoids boids. Everything is sized
+// at run time, so flock size is bounded only by memory.
+void allocBoids() {
+    allocVec3Array(&Boid_Location, nBoids);
+    allocVec3Array(&Boid_Velocity, nBoids);
+    allocVec3Array(&Next_Location, nBoids);
+    allocVec3Array(&Next_Velocity, nBoids);
+    Boid_Model_Vertex = (int *)calloc(nBoids, sizeof(int));
+    Boid_Id = (int *)malloc(nBoids*sizeof(int));
+    if (Boid_Model_Vertex == NULL || Boid_Id == NULL) {
+        fprintf(stderr,"Unable to allocate memory for %d boids\n", nBoids);
+        exit(1);
+    }
+    for (int i = 0; i < nBoids; i++) Boid_Id[i] = i;
+    Boid_Permuted = false;
+}
+
+void freeBoids() {
+    freeVec3Array(&Boid_Location);
+    freeVec3Array(&Boid_Velocity);
+    freeVec3Array(&Next_Location);
+    freeVec3Array(&Next_Velocity);
+    free(Boid_Model_Vertex);
+    free(Boid_Id);
+    freeVec3Array(&Boid_Grid.location);
+    freeVec3Array(&Boid_Grid.velocity);
+    free(Boid_Grid.leader);
+    free(Boid_Grid.boids);
+    free(Boid_Grid.boidCell);
+    free(Boid_Grid.cellStart);
+    memset(&Boid_Grid, 0, sizeof(Boid_Grid));
+    free(Boid_Lists.start);
+    free(Boid_Lists.neighbours);
+    free(Boid_Lists.leader);
+    freeVec3Array(&Boid_Lists.builtAt);
+    memset(&Boid_Lists, 0, sizeof(Boid_Lists));
+    for (int t = 0; t < List_Scratch_Threads; t++) free(List_Scratch[t]);
+    free(List_Scratch);
+    List_Scratch = NULL;
+    List_Scratch_Threads = List_Scratch_Capacity = 0;
+    for (int t = 0; t < Pair_Threads; t++) freePairSums(&Pair_Thread_Sums[t]);
+    free(Pair_Thread_Sums);
+    Pair_Thread_Sums = NULL;
+    Pair_Threads = Pair_Capacity = 0;
+    freePairSums(&Boid_Pair_Sums);
+    for (int f = 0; f < 3; f++) freeFrame(&Frames[f]);
+}
+
+// Returns whether the boid at index boidIdx is a leader
+bool isLeader(int boidIdx) {
+    for (int i = 0; i < nLeaders; ++i) {
+        if (Boid_Id[boidIdx] == leaders[i]) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,205 @@
+/***********************************************************
+                     BoidsSim.h
+
+	Boid simulation state and update functions,
+	shared by the interactive program (Boids.cpp)
+	and the headless benchmark (BoidsBench.cpp).
+	See BoidsSim.cpp.
+***********************************************************/
+
+#ifndef BOIDS_SIM_H
+#define BOIDS_SIM_H
+
+#define SPACE_SCALE 75
+#define SPEED_SCALE 5
+#define SIMD_WIDTH 16               // Floats in the widest SIMD register (AVX-512)
+#define MAX_GRID_DIM 64             // Max number of grid cells along each axis
+
+// Per-boid 3-vectors are stored as a structure of arrays: one array
+// per component, each 64-byte aligned (a cache line, and the width of
+// an AVX-512 register) and padded to a whole number of SIMD registers,
+// so loops over boids vectorize without peeling or gathers.
+// Allocated by allocVec3Array() once the number of boids is known.
+struct Vec3Array {
+    float *x;
+    float *y;
+    float *z;
+};
+
+// Uniform grid used to look up neighbouring boids. Boids are bucketed
+// by cell with a counting sort, so the boids of one cell sit next to
+// each other in boids[]. Cell c owns boids[cellStart[c]..cellStart[c+1]).
+struct SpatialGrid {
+    float origin[3];                // Lower corner of cell (0,0,0)
+    float cellSize;                 // Edge length of a (cubic) cell
+    int dims[3];                    // Number of cells along x, y, z
+    int nCells;                     // dims[0]*dims[1]*dims[2]
+    int cellCapacity;               // Allocated length of cellStart
+    int boidCapacity;               // Allocated length of the per-boid arrays
+    int *cellStart;                 // First entry in boids[] for each cell
+    int *boids;                     // Boid indices sorted by cell
+    int *boidCell;                  // Cell each boid was binned into
+    Vec3Array location;             // Copies of the boid positions,
+    Vec3Array velocity;             // velocities and leader flags (1 or 0)
+    float *leader;                  // in the same order as boids[]; the last
+                                    // two are unset in position-only grids
+};
+
+// Verlet neighbour lists: for every boid, the boids that were within
+// the widest rule radius plus a skin margin when the lists were built.
+// Boids move a fraction of a unit per tick, so the lists keep holding
+// every neighbour in range until some boid has moved more than half
+// the skin, and are only rebuilt then (see updateNeighbourLists()).
+// Boid i's neighbours, itself included, are neighbours[start[i]..start[i+1]).
+struct NeighbourLists {
+    float range;                    // Widest rule radius when built
+    float skin;                     // Margin beyond range
+    int nBoids;                     // Number of boids when built
+    int boidCapacity;               // Allocated length of the per-boid arrays
+    int capacity;                   // Allocated length of neighbours
+    int *start;
+    int *neighbours;
+    float *leader;                  // Leader flag (1 or 0) of each boid
+    Vec3Array builtAt;              // Boid positions when built
+    long builds;                    // Times the lists have been built
+};
+
+// Sums over the neighbours of every boid, one array per sum: the same
+// sums as NeighbourSums (BoidsKernels.h), for all boids at once. They
+// are indexed by grid slot while accumulatePairs() adds them up, and by
+// boid once it is done.
+struct PairSums {
+    Vec3Array centre;               // Positions within r_rule1, self included
+    Vec3Array separation;           // Offsets within r_rule2
+    Vec3Array velocity;             // Velocities within r_rule3, self excluded
+    Vec3Array leaderPull;           // Offsets to leaders within r_ruleLeader
+    float *n1, *n3;                 // Boids counted in centre and velocity
+};
+
+// The simulation runs on its own thread at a fixed tick rate, and hands
+// finished frames to the renderer through a lock-free triple buffer: the
+// simulation fills one frame, the renderer draws another, and the third
+// is the most recently published one. Publishing or picking up a frame
+// swaps the caller's frame with the shared one, so neither side ever
+// waits for the other.
+//
+// Each frame also holds the state one tick earlier, so the renderer can
+// draw the flock in between the two (see interpolateFrame()) and run at
+// a different rate from the simulation without the motion stuttering.
+struct BoidFrame {
+    Vec3Array location;             // Boid positions and velocities
+    Vec3Array velocity;             // at the end of a simulation tick
+    Vec3Array previousLocation;     // and at its start
+    Vec3Array previousVelocity;
+    long tick;                      // Tick that produced this frame
+    double time;                    // When the tick was due, in seconds, see getTime()
+    float tickLength;               // Seconds between ticks
+    float tickTime;                 // Seconds spent computing the tick
+};
+
+// Parameters of the boid update. The UI edits its own copies on the
+// render thread and hands them over with setParams(); the simulation
+// thread works from Sim_Params, refreshed at the start of every tick.
+struct BoidParams {
+    float r_rule1, r_rule2, r_rule3, r_ruleLeader;
+    float k_rule1, k_rule2, k_rule3, k_rule0, k_ruleLeader, k_ruleHover;
+    int nThreads;                   // Threads used for the boid update
+    float tickRate;                 // Simulation ticks per second
+    int substeps;                   // Most ticks run back to back to catch up
+    bool paused;                    // Stop advancing the flock
+    int kernel;                     // SIMD kernel for the neighbour sums, see BoidsKernels.h
+    float skin;                     // Margin of the neighbour lists, 0 to search the grid every tick
+    int reorderInterval;            // Ticks between reorderBoids() calls, 0 for never
+    bool pairs;                     // Visit each pair of boids once, see accumulatePairs()
+};
+
+// *************** GLOBAL VARIABLES *************************
+extern int nBoids;
+extern Vec3Array Boid_Location;
+extern Vec3Array Boid_Velocity;
+extern Vec3Array Next_Location;
+extern Vec3Array Next_Velocity;
+extern float *modelVertices;
+extern int *Boid_Model_Vertex;
+extern int *Boid_Id;
+extern bool Boid_Permuted;
+extern int n_vertices;
+extern int nLeaders;
+extern int leaders[5];
+extern SpatialGrid Boid_Grid;
+extern NeighbourLists Boid_Lists;
+extern PairSums Boid_Pair_Sums;
+extern BoidFrame Frames[3];
+extern int Frame_Reading;           // Frame the renderer is drawing
+extern BoidParams Sim_Params;
+extern long Sim_Tick;
+extern long Sim_Visited;
+
+// ***********  FUNCTION HEADER DECLARATIONS ****************
+// Setting up the flock
+void defaultParams(BoidParams *params);
+float defaultSkin(int kernel);
+void allocBoids();
+void freeBoids();
+void randomizeBoids(long seed);
+void chooseLeaders();
+void assignToModelVertices();
+
+// Advancing the flock
+int updateBoid(int i);
+void dampVelocities();
+void swapBoidState();
+void stepSimulation();
+int applyRules(int boidIdx, float *v1, float *v2, float *v3, float *vLead);
+void followModelVertex(int boidIdx, float *v);
+void reorderBoids();
+
+// Simulation thread and hand-over to the renderer
+void startSimulation();
+void stopSimulation();
+void simulationThread();
+bool advanceSimulation(double time);
+void setParams(const BoidParams *params);
+void fetchParams();
+void initFrames();
+void publishFrame(double time);
+bool acquireFrame();
+bool frameReady();
+void allocFrame(BoidFrame *frame);
+void freeFrame(BoidFrame *frame);
+void interpolateFrame(BoidFrame *frame, float alpha, BoidFrame *out);
+
+// General helper functions
+void buildGrid(SpatialGrid *grid, Vec3Array *location, Vec3Array *velocity, float cellSize);
+int gridCell(SpatialGrid *grid, float coord, int axis);
+void flockBounds(Vec3Array *location, float *lo, float *hi);
+unsigned int mortonCode(unsigned int x, unsigned int y, unsigned int z);
+int gridNeighbours(SpatialGrid *grid, int boidIdx, float reach, int *list);
+bool updateNeighbourLists(NeighbourLists *lists, float range, float skin);
+void buildNeighbourLists(NeighbourLists *lists, float range, float skin);
+float maxDisplacementSq(Vec3Array *from);
+long accumulatePairs(SpatialGrid *grid);
+void allocPairSums(PairSums *sums, int n);
+void freePairSums(PairSums *sums);
+void clearPairSums(PairSums *sums);
+bool isLeader(int boidIdx);
+float *allocAligned(int n);
+void allocVec3Array(Vec3Array *a, int n);
+void freeVec3Array(Vec3Array *a);
+void copyVec3Array(Vec3Array *to, Vec3Array *from);
+void scatterVec3Array(Vec3Array *to, Vec3Array *from, int *index);
+void copyInIdOrder(Vec3Array *to, Vec3Array *from);
+
+// Squared length of (x, y, z). Distances are compared squared, against
+// squared radii, so the neighbour searches never take a square root.
+// Inline so the loops using it still vectorize.
+inline float lengthSq(float x, float y, float z) {
+    return x*x + y*y + z*z;
+}
+
+// Squared distance from a to (x, y, z)
+inline float distanceSq(const float *a, float x, float y, float z) {
+    return lengthSq(x - a[0], y - a[1], z - a[2]);
+}
+
+#endif
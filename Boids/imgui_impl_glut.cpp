@@ -15,7 +15,11 @@
 #include <iostream>
 
 // GLUT
+#ifdef __APPLE__
 #include <GLUT/GLUT.h>
+#else
+#include <GL/glut.h>
+#endif
 
 // Data
 static double       g_Time = 0.0f;